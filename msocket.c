@@ -7,418 +7,1450 @@
 */
 #include <msocket.h>
 
-SOCK_INFO *m_sock_info;
-int m_sock_info_mutex;
-int m_init_comm_mutex;
-struct sembuf m_pop = {0, -1, 0};
-struct sembuf m_vop = {0, 1, 0};
-
 mtp_socket *m_SM = NULL;
+mtp_control *m_ctrl = NULL;
 int m_sm_shmid;
-int m_sm_mutex;
 int m_debug = 0;
+int m_doorbell_fd = -1; // unix datagram socket used to wake up the workers of initmsocket
+void (*m_embedded)(mtp_request *r) = NULL; // set by m_embed: the engine runs in this process and carries out the requests
+int (*m_embedded_kick)(int i) = NULL;      // set by m_embed: does the work of the worker of socket i if it is idle
 
-int m_socket(int domain, int type, int protocol)
+// ------------------------------------------ Process Context ------------------------------------------
+// The shared memory of initmsocket is looked up and attached once per process.
+// Attachments are inherited across fork(); after exec() the context is attached again on first use.
+// A process that embeds the engine (m_embed) is attached to its own table for good, which fork() does not share.
+// m_attached is set once the globals are in place; the attach itself is serialized by m_attach_lock, so that threads
+// making their first m_* call together attach the segments once and never see a half set up context.
+int m_attached = 0;
+pthread_mutex_t m_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void m_fini()
 {
-    if (type != SOCK_MTP)
+    pthread_mutex_lock(&m_attach_lock);
+    if (m_attached && m_embedded == NULL)
     {
-        errno = ENOTSUP;
+        __atomic_store_n(&m_attached, 0, __ATOMIC_RELEASE);
+        shmdt(m_SM);
+        shmdt(m_ctrl);
+        close(m_doorbell_fd);
+        m_doorbell_fd = -1;
+        m_SM = NULL;
+        m_ctrl = NULL;
+    }
+    pthread_mutex_unlock(&m_attach_lock);
+}
+
+// Attach the segments of initmsocket, called with m_attach_lock held
+int m_attach()
+{
+    static int registered = 0;
+    if (m_attached)
+        return 0;
+
+    // the table is sized by initmsocket, so the segments are looked up whatever their size
+    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), 0, 0);
+    int ctrl_shmid = shmget(ftok("initmsocket.c", MTP_CONTROL_KEY), 0, 0);
+    if (m_sm_shmid == -1 || ctrl_shmid == -1)
+    {
+        // initmsocket is not running
+        errno = ENOENT;
         return -1;
     }
-    // ----------------------------- Check if there is a free entry in m_SM -----------------------------
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0);
-    m_pop.sem_num = 0;
-    semop(m_sm_mutex, &m_pop, 1); // wait on m_sm_mutex
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
 
-    int i;
-    for (i = 0; i < MAX_SOCKETS; i++)
+    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+    if (m_SM == (void *)-1)
     {
-        if (m_SM[i].is_free == 1)
-        {
-            break;
-        }
+        m_SM = NULL;
+        return -1;
+    }
+    m_ctrl = (mtp_control *)shmat(ctrl_shmid, (void *)0, 0);
+    if (m_ctrl == (void *)-1)
+    {
+        shmdt(m_SM);
+        m_SM = NULL;
+        m_ctrl = NULL;
+        return -1;
     }
+    m_doorbell_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_doorbell_fd == -1)
+    {
+        shmdt(m_SM);
+        shmdt(m_ctrl);
+        m_SM = NULL;
+        m_ctrl = NULL;
+        return -1;
+    }
+    __atomic_store_n(&m_attached, 1, __ATOMIC_RELEASE);
 
-    if (i >= MAX_SOCKETS)
+    if (!registered)
     {
+        atexit(m_fini);
+        registered = 1;
+    }
+    return 0;
+}
 
-        // signal m_sm_mutex
-        semop(m_sm_mutex, &m_vop, 1);
+int m_init()
+{
+    // every m_* call goes through here, only the first ones take the lock
+    if (__atomic_load_n(&m_attached, __ATOMIC_ACQUIRE))
+        return 0;
+    pthread_mutex_lock(&m_attach_lock);
+    int ret = m_attach();
+    int err = errno;
+    pthread_mutex_unlock(&m_attach_lock);
+    errno = err;
+    return ret;
+}
 
-        // free resources
-        shmdt(m_SM);
-        errno = ENOBUFS;
+int m_engine_claim()
+{
+    pthread_mutex_lock(&m_attach_lock);
+    if (m_attached)
+    {
+        pthread_mutex_unlock(&m_attach_lock);
+        errno = EISCONN;
+        return -1;
+    }
+    return 0;
+}
 
+// Called with the claim held; the calls of the other threads wait for m_engine_release, so the engine is only used
+// once it runs
+int m_attach_engine(mtp_socket *sm, mtp_control *ctrl, void (*handler)(mtp_request *r), int (*kick)(int i))
+{
+    m_doorbell_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_doorbell_fd == -1)
         return -1;
+    m_SM = sm;
+    m_ctrl = ctrl;
+    m_embedded = handler;
+    m_embedded_kick = kick;
+    return 0;
+}
+
+void m_engine_release(int attached)
+{
+    if (attached)
+    {
+        __atomic_store_n(&m_attached, 1, __ATOMIC_RELEASE);
+    }
+    else if (m_embedded != NULL)
+    {
+        close(m_doorbell_fd);
+        m_doorbell_fd = -1;
+        m_SM = NULL;
+        m_ctrl = NULL;
+        m_embedded = NULL;
+        m_embedded_kick = NULL;
     }
+    pthread_mutex_unlock(&m_attach_lock);
+}
 
-    // signal m_sm_mutex
-    semop(m_sm_mutex, &m_vop, 1);
+// ------------------------------------------ Locks ------------------------------------------
+// The entry and table locks are robust, process-shared mutexes in the shared segments: the uncontended lock and
+// unlock are atomic operations in user space, the kernel is only entered to sleep or wake on contention, and the
+// kernel hands the lock of a thread that died holding it to the next locker with EOWNERDEAD.
+int m_mutex_init(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret == 0 ? 0 : -1;
+}
 
-    // ----------------------------- Create UDP socket via initmsocket.c -----------------------------
-    m_init_comm_mutex = semget(ftok("initmsocket.c", INIT_COMM_MUTEX_KEY), 2, 0);
-    m_sock_info_mutex = semget(ftok("initmsocket.c", SOCK_INFO_MUTEX_KEY), 1, 0);
-    m_pop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_pop, 1); // wait on m_sock_info_mutex
-    int sock_info_shmid = shmget(ftok("initmsocket.c", SOCK_INFO_KEY), sizeof(SOCK_INFO), 0);
-    m_sock_info = (SOCK_INFO *)shmat(sock_info_shmid, (void *)0, 0);
-    memset(m_sock_info, 0, sizeof(SOCK_INFO));
-    m_vop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_vop, 1); // signal m_sock_info_mutex
+int m_mutex_lock(pthread_mutex_t *mutex)
+{
+    if (pthread_mutex_lock(mutex) != EOWNERDEAD)
+        return 0;
+    // the updates under the lock are small enough to be left as they are, the entries of a dead process are
+    // released by the garbage collector of initmsocket
+    pthread_mutex_consistent(mutex);
+    return 1;
+}
 
-    // signal sem1
-    m_vop.sem_num = 0;
-    semop(m_init_comm_mutex, &m_vop, 1);
+void m_mutex_unlock(pthread_mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
 
-    // wait on sem2
-    m_pop.sem_num = 1;
-    semop(m_init_comm_mutex, &m_pop, 1);
+// Every write to an entry is made with its lock held, so stats_seq is bumped to odd when the lock is taken and back
+// to even when it is released: a reader without the lock (m_getstats) retries until it sees the same even value
+// before and after reading. A holder that died leaves it odd, the next holder keeps it odd and makes it even
+int m_entry_lock(mtp_socket *entry)
+{
+    int recovered = m_mutex_lock(&entry->lock);
+    __atomic_store_n(&entry->stats_seq, entry->stats_seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return recovered;
+}
 
-    if (m_sock_info->sock_id == -1)
-    {
-        int err_no = m_sock_info->err_no;
+void m_entry_unlock(mtp_socket *entry)
+{
+    __atomic_store_n(&entry->stats_seq, entry->stats_seq + 1, __ATOMIC_RELEASE);
+    m_mutex_unlock(&entry->lock);
+}
 
-        // free resources
-        shmdt(m_sock_info);
-        shmdt(m_SM);
-        errno = err_no;
-        return -1;
+// current CLOCK_MONOTONIC time in microseconds
+long long m_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Send one request to initmsocket and wait for its answer (see m_request_claim)
+// Returns the sock_id of the answer, -1 with errno set on failure
+int m_request(int op, int sock_id, int mtp_id, const char *ip, int port)
+{
+    mtp_request local;
+    mtp_request *r = m_embedded != NULL ? &local : m_request_claim(m_ctrl);
+    r->op = op;
+    r->sock_id = sock_id;
+    r->mtp_id = mtp_id;
+    if (ip != NULL)
+    {
+        strncpy(r->IP, ip, sizeof(r->IP) - 1);
+        r->IP[sizeof(r->IP) - 1] = '\0';
     }
+    r->port = port;
+    if (m_embedded != NULL)
+    {
+        // the engine is in this process, the request is carried out right here
+        m_embedded(r);
+        if (r->sock_id == -1)
+            errno = r->err_no;
+        return r->sock_id;
+    }
+    m_request_submit(m_ctrl, r);
+    m_request_wait(r);
+    int ret = r->sock_id, err = r->err_no;
+    m_request_release(r);
+    if (ret == -1)
+        errno = err;
+    return ret;
+}
 
+// Set up entry i for a new MTP socket on UDP socket udp_sock, called with the entry lock held
+void m_entry_init(int i, int udp_sock)
+{
     m_SM[i].is_free = 0;
-    m_SM[i].udp_sock = m_sock_info->sock_id;
+    m_SM[i].udp_sock = udp_sock;
     m_SM[i].pid = getpid();
+    m_SM[i].pid_start = m_self_start();
 
     if (m_debug)
         printf("[msocket.c] Socket Created %d=>%d pid:%d\n", i, m_SM[i].udp_sock, m_SM[i].pid);
 
     // initialize the send and receive windows
-    for (int j = 0; j < MAX_RECEIVE_BUFFER_SIZE; j++)
+    // the buffers themselves are not cleared, an entry is free when its length is 0
+    memset(m_SM[i].receive_len, 0, sizeof(m_SM[i].receive_len));
+    memset(m_SM[i].send_len, 0, sizeof(m_SM[i].send_len));
+    m_SM[i].swnd.size = MAX_WINDOW_SIZE;
+    m_SM[i].swnd.base = 1;
+    m_SM[i].swnd.next = 1;
+    m_SM[i].num_messages_sent = 0;
+    m_SM[i].send_waiters = 0;
+    m_SM[i].receive_waiters = 0;
+    m_SM[i].window_update = 0;
+    m_SM[i].send_reserved = 0;
+    m_SM[i].recv_peeked = 0;
+    m_SM[i].recv_offset = 0;
+    m_SM[i].stream_tail = 0;
+    m_SM[i].srtt = 0;
+    m_SM[i].rttvar = 0;
+    m_SM[i].rto = RTO_INITIAL;
+    m_SM[i].rto_backoff = 0;
+    m_SM[i].dup_acks = 0;
+    m_SM[i].in_recovery = 0;
+    m_SM[i].persist = 0;
+    memset(&m_SM[i].counters, 0, sizeof(mtp_counters));
+    m_SM[i].cc.algo = CC_RENO;
+    mtp_cc_algos[CC_RENO]->init(&m_SM[i].cc);
+    m_SM[i].rwnd.size = MAX_RECEIVE_BUFFER_SIZE;
+    m_SM[i].rwnd.base = 1;
+    m_SM[i].rwnd.next = 1;
+}
+
+int m_socket(int domain, int type, int protocol)
+{
+    int sockfd;
+    if (m_socket_batch(domain, type, protocol, &sockfd, 1) < 1)
+        return -1;
+    return sockfd;
+}
+
+int m_socket_batch(int domain, int type, int protocol, int *sockfds, int n)
+{
+    if (type != SOCK_MTP)
     {
-        memset(m_SM[i].receive_buffer[j], 0, MESSAGE_SIZE);
+        errno = ENOTSUP;
+        return -1;
     }
-    for (int j = 0; j < MAX_SEND_BUFFER_SIZE; j++)
+    if (n < 1)
     {
-        memset(m_SM[i].send_buffer[j], 0, MESSAGE_SIZE);
+        errno = EINVAL;
+        return -1;
     }
-    m_SM[i].swnd.size = 5;
-    for (int j = 0; j < 5; j++)
+    if (m_init() < 0)
+        return -1;
+
+    int created = 0, err = 0;
+    while (created < n && err == 0)
     {
-        m_SM[i].swnd.sequence_numbers[j] = -1;
+        // ----------------------------- Create the UDP sockets via initmsocket.c -----------------------------
+        // the requests of a chunk are in the ring together, initmsocket answers them in one pass
+        mtp_request *reqs[MTP_REQUEST_BATCH];
+        int count = n - created < MTP_REQUEST_BATCH ? n - created : MTP_REQUEST_BATCH;
+        if (m_ctrl->active_count + count > m_ctrl->max_sockets)
+            count = m_ctrl->max_sockets - m_ctrl->active_count;
+        if (count <= 0)
+        {
+            err = ENOBUFS;
+            break;
+        }
+        int udp_socks[MTP_REQUEST_BATCH], got = 0;
+        for (int k = 0; k < count && m_embedded != NULL; k++)
+        {
+            int udp_sock = m_request(MTP_OP_SOCKET, 0, 0, NULL, 0);
+            if (udp_sock == -1)
+                err = errno;
+            else
+                udp_socks[got++] = udp_sock;
+        }
+        for (int k = 0; k < count && m_embedded == NULL; k++)
+        {
+            reqs[k] = m_request_claim(m_ctrl);
+            reqs[k]->op = MTP_OP_SOCKET;
+            m_request_submit(m_ctrl, reqs[k]);
+        }
+        for (int k = 0; k < count && m_embedded == NULL; k++)
+        {
+            m_request_wait(reqs[k]);
+            if (reqs[k]->sock_id == -1)
+                err = reqs[k]->err_no;
+            else
+                udp_socks[got++] = reqs[k]->sock_id;
+            m_request_release(reqs[k]);
+        }
+
+        // ----------------------------- Take the lowest free entries -----------------------------
+        // the table lock is only held to allocate, so that two processes never claim the same entry
+        int k = 0;
+        m_mutex_lock(&m_ctrl->table_lock);
+        for (; k < got && m_ctrl->active_count < m_ctrl->max_sockets; k++)
+        {
+            int i = m_table_alloc(m_ctrl);
+            m_entry_lock(&m_SM[i]);
+            m_entry_init(i, udp_socks[k]);
+            m_entry_unlock(&m_SM[i]);
+            sockfds[created++] = i;
+        }
+        m_mutex_unlock(&m_ctrl->table_lock);
+
+        // other processes took the entries meanwhile, give the UDP sockets back
+        for (; k < got; k++)
+        {
+            m_request(MTP_OP_CLOSE, udp_socks[k], 0, NULL, 0);
+            err = ENOBUFS;
+        }
     }
-    m_SM[i].num_messages_sent = 0;
-    m_SM[i].rwnd.size = 5;
-    for (int j = 0; j < 5; j++)
+    if (created == 0)
     {
-        m_SM[i].receive_seq_num[j] = j + 1;
+        errno = err;
+        return -1;
     }
-    // free resources
-    shmdt(m_sock_info);
-    shmdt(m_SM);
-
-    return i;
+    return created;
 }
 
 int m_bind(int sockfd, char *source_ip, int source_port, char *dest_ip, int dest_port)
 {
     // ----------------------------- Find the corresponding actual UDP socket id from the m_SM table -----------------------------
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0666 | IPC_CREAT);
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS)
+    if (m_init() < 0)
+        return -1;
+    if (sockfd < 0 || sockfd >= m_ctrl->max_sockets)
     {
         errno = EBADF;
         return -1;
     }
-    // wait on m_sm_mutex
-    semop(m_sm_mutex, &m_pop, 1);
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+    m_entry_lock(&m_SM[sockfd]);
     int udp_sock = m_SM[sockfd].udp_sock;
 
     // if the UDP socket ID is 0, then it is not initialized
     if (udp_sock == 0 || udp_sock == -1)
     {
-
-        // signal m_sm_mutex
-        semop(m_sm_mutex, &m_vop, 1);
-
-        // free resources
-        shmdt(m_SM);
+        m_entry_unlock(&m_SM[sockfd]);
         errno = ENOTSOCK;
 
         return -1;
     }
-    // signal m_sm_mutex
-    semop(m_sm_mutex, &m_vop, 1);
+    m_entry_unlock(&m_SM[sockfd]);
+
+    // ----------------------------- Bind the UDP socket via initmsocket.c -----------------------------
+    if (m_request(MTP_OP_BIND, udp_sock, sockfd, source_ip, source_port) == -1)
+        return -1;
 
-    // ----------------------------- Put the UDP socket ID, IP, and port in SOCK_INFO table -----------------------------
-    m_init_comm_mutex = semget(ftok("initmsocket.c", INIT_COMM_MUTEX_KEY), 2, 0666 | IPC_CREAT);
-    m_sock_info_mutex = semget(ftok("initmsocket.c", SOCK_INFO_MUTEX_KEY), 1, 0666 | IPC_CREAT);
+    // valid bind done
+    m_entry_lock(&m_SM[sockfd]);
+    m_SM[sockfd].source_port = source_port;
+    strcpy(m_SM[sockfd].source_ip, source_ip);
+    m_SM[sockfd].dest_port = dest_port;
+    strcpy(m_SM[sockfd].dest_ip, dest_ip);
+    m_entry_unlock(&m_SM[sockfd]);
+
+    return 0;
+}
 
-    m_pop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_pop, 1); // wait on m_sock_info_mutex
-    int sock_info_shmid = shmget(ftok("initmsocket.c", SOCK_INFO_KEY), sizeof(SOCK_INFO), 0);
-    m_sock_info = (SOCK_INFO *)shmat(sock_info_shmid, (void *)0, 0);
-    // set SOCK_INFO fields
-    m_sock_info->sock_id = udp_sock;
-    strcpy(m_sock_info->IP, source_ip);
-    m_sock_info->port = source_port;
-    m_vop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_vop, 1); // signal m_sock_info_mutex
+// ------------------------------------------ Blocking ------------------------------------------
+int m_futex_wait(volatile int *addr, int val, const struct timespec *deadline)
+{
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, so spurious wakeups do not extend the wait
+    int ret = syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (ret == -1 && errno == EAGAIN)
+        return 0; // *addr already changed
+    return ret;
+}
 
-    m_vop.sem_num = 0;
-    semop(m_init_comm_mutex, &m_vop, 1); // signal sem1
-    m_pop.sem_num = 1;
-    semop(m_init_comm_mutex, &m_pop, 1); // wait on sem2
+void m_futex_wake(volatile int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// ------------------------------------------ Processes ------------------------------------------
+// The sockets and the request slots record their process as its pid and start time, so that G and initmsocket
+// reclaim them only once that very process is gone.
+unsigned long long m_process_start(int pid)
+{
+    char path[32], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    int n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    stat[n] = '\0';
+    // the command name in parentheses may hold spaces and parentheses, the fields are counted after the last ')':
+    // state is field 3 and starttime field 22
+    char *p = strrchr(stat, ')');
+    if (p == NULL)
+        return 0;
+    p++;
+    for (int field = 3; field < 22 && p != NULL; field++)
+        p = strchr(p + 1, ' ');
+    return p == NULL ? 0 : strtoull(p + 1, NULL, 10);
+}
 
-    if (m_sock_info->sock_id == -1)
+unsigned long long m_self_start()
+{
+    // a child of fork() reads its own on first use
+    static int pid = 0;
+    static unsigned long long start = 0;
+    int self = getpid();
+    if (__atomic_load_n(&pid, __ATOMIC_ACQUIRE) != self)
     {
-        int error_no = m_sock_info->err_no;
+        __atomic_store_n(&start, m_process_start(self), __ATOMIC_RELAXED);
+        __atomic_store_n(&pid, self, __ATOMIC_RELEASE);
+    }
+    return __atomic_load_n(&start, __ATOMIC_RELAXED);
+}
 
-        // reset all fields of SOCK_INFO to 0
-        m_pop.sem_num = 0;
-        semop(m_sock_info_mutex, &m_pop, 1); // wait on m_sock_info_mutex
-        memset(m_sock_info, 0, sizeof(SOCK_INFO));
-        m_vop.sem_num = 0;
-        semop(m_sock_info_mutex, &m_vop, 1); // signal m_sock_info_mutex
+int m_process_alive(int pid, unsigned long long start)
+{
+    if (kill(pid, 0) == -1 && errno == ESRCH)
+        return 0;
+    // a pid that went to a new process; a start time that cannot be read is taken for the same process
+    unsigned long long now = start != 0 ? m_process_start(pid) : 0;
+    return now == 0 || now == start;
+}
 
-        // free resources
-        shmdt(m_sock_info);
-        shmdt(m_SM);
+// ------------------------------------------ Socket Table ------------------------------------------
+// words of the free bitmap and of its summary for a table of n entries
+#define TABLE_MAP_WORDS(n) (((n) + 63) / 64)
+#define TABLE_SUMMARY_WORDS(n) (((n) + 4095) / 4096)
+// the ready bitmaps of a worker cover its shard, socket i is entry i / workers of the shard of worker i % workers
+#define SHARD_SIZE(n, workers) (((n) + (workers) - 1) / (workers))
+#define READY_WORDS(n, workers) (TABLE_SUMMARY_WORDS(SHARD_SIZE(n, workers)) + TABLE_MAP_WORDS(SHARD_SIZE(n, workers)))
 
-        errno = error_no;
-        return -1;
+size_t m_control_size(int max_sockets, int workers)
+{
+    return sizeof(mtp_control) + (TABLE_SUMMARY_WORDS(max_sockets) + TABLE_MAP_WORDS(max_sockets) + workers * READY_WORDS(max_sockets, workers)) * sizeof(uint64_t) + 2 * max_sockets * sizeof(int);
+}
+
+uint64_t *m_table_summary(mtp_control *ctrl)
+{
+    return ctrl->table;
+}
+
+uint64_t *m_table_map(mtp_control *ctrl)
+{
+    return ctrl->table + TABLE_SUMMARY_WORDS(ctrl->max_sockets);
+}
+
+// summary words of the ready bitmap of worker w, followed by its words
+uint64_t *m_table_ready_summary(mtp_control *ctrl, int w)
+{
+    return m_table_map(ctrl) + TABLE_MAP_WORDS(ctrl->max_sockets) + w * READY_WORDS(ctrl->max_sockets, ctrl->workers);
+}
+
+int *m_table_active(mtp_control *ctrl)
+{
+    return (int *)m_table_ready_summary(ctrl, ctrl->workers);
+}
+
+int *m_table_active_pos(mtp_control *ctrl)
+{
+    return m_table_active(ctrl) + ctrl->max_sockets;
+}
+
+void m_table_init(mtp_control *ctrl, int max_sockets, int workers)
+{
+    ctrl->max_sockets = max_sockets;
+    ctrl->workers = workers;
+    ctrl->active_count = 0;
+    m_mutex_init(&ctrl->table_lock);
+    ctrl->request_head = 0;
+    ctrl->request_tail = 0;
+    ctrl->request_event = 0;
+    for (int k = 0; k < MTP_REQUEST_RING; k++)
+    {
+        ctrl->request[k].seq = k;
+        ctrl->request[k].pid = 0;
     }
+    uint64_t *map = m_table_map(ctrl), *summary = m_table_summary(ctrl);
+    memset(summary, 0, m_control_size(max_sockets, workers) - sizeof(mtp_control));
+    for (int w = 0; w < TABLE_MAP_WORDS(max_sockets); w++)
+    {
+        // the bits past the end of the table stay clear
+        int bits = max_sockets - 64 * w < 64 ? max_sockets - 64 * w : 64;
+        map[w] = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+        summary[w / 64] |= 1ULL << (w % 64);
+    }
+}
 
-    // valid bind done
-    m_SM[sockfd].source_port = source_port;
-    strcpy(m_SM[sockfd].source_ip, source_ip);
-    m_SM[sockfd].dest_port = dest_port;
-    strcpy(m_SM[sockfd].dest_ip, dest_ip);
+int m_table_alloc(mtp_control *ctrl)
+{
+    uint64_t *map = m_table_map(ctrl), *summary = m_table_summary(ctrl);
+    for (int s = 0; s < TABLE_SUMMARY_WORDS(ctrl->max_sockets); s++)
+    {
+        if (summary[s] == 0)
+            continue;
+        int w = 64 * s + __builtin_ctzll(summary[s]);
+        int i = 64 * w + __builtin_ctzll(map[w]);
+        map[w] &= map[w] - 1;
+        if (map[w] == 0)
+            summary[s] &= ~(1ULL << (w % 64));
 
-    // reset all fields of SOCK_INFO to 0
-    m_pop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_pop, 1); // wait on m_sock_info_mutex
-    memset(m_sock_info, 0, sizeof(SOCK_INFO));
-    m_vop.sem_num = 0;
-    semop(m_sock_info_mutex, &m_vop, 1); // signal m_sock_info_mutex
+        // publish the entry before the count, the workers and G read the list without the table mutex
+        int *active = m_table_active(ctrl);
+        int count = ctrl->active_count;
+        active[count] = i;
+        m_table_active_pos(ctrl)[i] = count;
+        __atomic_store_n(&ctrl->active_count, count + 1, __ATOMIC_RELEASE);
+        return i;
+    }
+    return -1;
+}
 
-    // free resources
-    shmdt(m_sock_info);
-    shmdt(m_SM);
+void m_table_release(mtp_control *ctrl, int i)
+{
+    uint64_t *map = m_table_map(ctrl), *summary = m_table_summary(ctrl);
+    int w = i / 64;
+    map[w] |= 1ULL << (i % 64);
+    summary[w / 64] |= 1ULL << (w % 64);
 
+    // move the last entry in use into the released position
+    int *active = m_table_active(ctrl), *pos = m_table_active_pos(ctrl);
+    int count = ctrl->active_count - 1;
+    int last = active[count];
+    active[pos[i]] = last;
+    pos[last] = pos[i];
+    __atomic_store_n(&ctrl->active_count, count, __ATOMIC_RELEASE);
+}
+
+void m_mark_ready(mtp_control *ctrl, int i)
+{
+    int w = i % ctrl->workers, k = i / ctrl->workers;
+    uint64_t *ready_summary = m_table_ready_summary(ctrl, w);
+    uint64_t *ready_map = ready_summary + TABLE_SUMMARY_WORDS(SHARD_SIZE(ctrl->max_sockets, ctrl->workers));
+    __atomic_fetch_or(&ready_map[k / 64], 1ULL << (k % 64), __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&ready_summary[k / 4096], 1ULL << (k / 64 % 64), __ATOMIC_SEQ_CST);
+}
+
+int m_table_ready(mtp_control *ctrl, int w, int *ready)
+{
+    int summary_words = TABLE_SUMMARY_WORDS(SHARD_SIZE(ctrl->max_sockets, ctrl->workers));
+    uint64_t *ready_summary = m_table_ready_summary(ctrl, w), *ready_map = ready_summary + summary_words;
+    int n = 0;
+    for (int s = 0; s < summary_words; s++)
+    {
+        // clear the summary before the words, a mark made meanwhile sets the summary bit again
+        uint64_t words = __atomic_exchange_n(&ready_summary[s], 0, __ATOMIC_SEQ_CST);
+        while (words)
+        {
+            int m = 64 * s + __builtin_ctzll(words);
+            words &= words - 1;
+            uint64_t bits = __atomic_exchange_n(&ready_map[m], 0, __ATOMIC_SEQ_CST);
+            while (bits)
+            {
+                ready[n++] = (64 * m + __builtin_ctzll(bits)) * ctrl->workers + w;
+                bits &= bits - 1;
+            }
+        }
+    }
+    return n;
+}
+
+int m_table_ready_pending(mtp_control *ctrl, int w)
+{
+    uint64_t *ready_summary = m_table_ready_summary(ctrl, w);
+    for (int s = 0; s < TABLE_SUMMARY_WORDS(SHARD_SIZE(ctrl->max_sockets, ctrl->workers)); s++)
+    {
+        if (__atomic_load_n(&ready_summary[s], __ATOMIC_SEQ_CST))
+            return 1;
+    }
     return 0;
 }
 
+void m_worker_addr(int w, struct sockaddr_un *addr, socklen_t *len)
+{
+    // abstract unix socket, named after the IPC key of the daemon so that it goes away with it,
+    // or after the process for an embedded engine
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    int n;
+    if (m_embedded != NULL)
+        n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "mtp-pid-%d-%d", (int)getpid(), w);
+    else
+        n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "mtp-%x-%d", (unsigned)ftok("initmsocket.c", MTP_CONTROL_KEY), w);
+    *len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+// Hand the new work of sockfd to its worker, called without the entry lock
+// An embedded engine sends it from this thread when the worker is idle, so the worker is not woken up for it
+void m_ring(int sockfd)
+{
+    if (m_embedded_kick == NULL || !m_embedded_kick(sockfd))
+        m_doorbell(m_ctrl, sockfd);
+}
+
+void m_doorbell(mtp_control *ctrl, int i)
+{
+    // mark the socket before looking at the worker, which sets sleeping before it looks at its marks
+    m_mark_ready(ctrl, i);
+    int w = i % ctrl->workers;
+    if (__atomic_load_n(&ctrl->worker[w].sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ctrl->worker[w].sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        // only the first ringer of a sleeping worker sends a wakeup datagram
+        struct sockaddr_un addr;
+        socklen_t len;
+        m_worker_addr(w, &addr, &len);
+        sendto(m_doorbell_fd, "", 1, MSG_DONTWAIT, (struct sockaddr *)&addr, len);
+    }
+}
+
+// ------------------------------------------ Requests ------------------------------------------
+// Bounded multi-producer ring: the turn in seq of the slot of position pos is pos while it is free, pos + 1 once its
+// request is published, and pos + MTP_REQUEST_RING when its requester has read the answer and released it.
+// initmsocket takes the requests in order of position; the answer is written in the slot, so a requester only waits
+// for its own request and any number of processes create and bind sockets concurrently.
+mtp_request *m_request_claim(mtp_control *ctrl)
+{
+    unsigned long long start = m_self_start();
+    unsigned int pos = __atomic_load_n(&ctrl->request_tail, __ATOMIC_RELAXED);
+    while (1)
+    {
+        mtp_request *r = &ctrl->request[pos % MTP_REQUEST_RING];
+        unsigned int seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - pos);
+        if (diff == 0)
+        {
+            // the position is ours if no other requester took it meanwhile, otherwise pos is reloaded
+            if (__atomic_compare_exchange_n(&ctrl->request_tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                r->done = 0;
+                r->pid_start = start;
+                __atomic_store_n(&r->pid, getpid(), __ATOMIC_RELEASE);
+                return r;
+            }
+            continue;
+        }
+        if (diff < 0)
+        {
+            // the ring is full, wait for the requester of the previous turn to release the slot
+            m_futex_wait((volatile int *)&r->seq, (int)seq, NULL);
+        }
+        pos = __atomic_load_n(&ctrl->request_tail, __ATOMIC_RELAXED);
+    }
+}
+
+void m_request_submit(mtp_control *ctrl, mtp_request *r)
+{
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ctrl->request_event, 1, __ATOMIC_SEQ_CST);
+    m_futex_wake(&ctrl->request_event);
+}
+
+void m_request_wait(mtp_request *r)
+{
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+        m_futex_wait(&r->done, 0, NULL);
+}
+
+void m_request_release(mtp_request *r)
+{
+    __atomic_store_n(&r->pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->seq, r->seq - 1 + MTP_REQUEST_RING, __ATOMIC_RELEASE);
+    m_futex_wake((volatile int *)&r->seq);
+}
+
+mtp_request *m_request_next(mtp_control *ctrl)
+{
+    mtp_request *r = &ctrl->request[ctrl->request_head % MTP_REQUEST_RING];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ctrl->request_head + 1)
+        return NULL;
+    return r;
+}
+
+void m_request_answer(mtp_control *ctrl, mtp_request *r)
+{
+    ctrl->request_head++;
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    m_futex_wake(&r->done);
+}
+
+// Fill deadline with now + timeout_ms on CLOCK_MONOTONIC, returns NULL for an infinite timeout (timeout_ms < 0)
+struct timespec *m_deadline(int timeout_ms, struct timespec *deadline)
+{
+    if (timeout_ms < 0)
+        return NULL;
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// Sleep until *event is bumped by initmsocket or the deadline passes
+// Must be called with the entry lock of sockfd held, the lock is released while sleeping and held again on return
+// Returns 0 when woken up, -1 with errno ETIMEDOUT or EINTR otherwise
+int m_wait_event(int sockfd, volatile int *event, int *waiters, const struct timespec *deadline)
+{
+    int val = *event;
+    (*waiters)++;
+    m_entry_unlock(&m_SM[sockfd]);
+
+    int ret = m_futex_wait(event, val, deadline);
+    int err = errno;
+
+    m_entry_lock(&m_SM[sockfd]);
+    (*waiters)--;
+    errno = err;
+    return ret;
+}
+
 int m_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
 {
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS)
+    return m_sendto_timeout(sockfd, buf, len, flags, dest_addr, addrlen, -1);
+}
+
+int m_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    return m_recvfrom_timeout(sockfd, buf, len, flags, src_addr, addrlen, -1);
+}
+
+// Unlock the entry of sockfd
+void m_unlock_entry(int sockfd)
+{
+    m_entry_unlock(&m_SM[sockfd]);
+}
+
+// Lock the entry of sockfd, which must be an MTP socket in use
+// Returns 0 with the entry lock held, -1 with errno set otherwise
+int m_lock_entry(int sockfd)
+{
+    if (m_init() < 0)
+        return -1;
+    if (sockfd < 0 || sockfd >= m_ctrl->max_sockets)
     {
         errno = EBADF;
         return -1;
     }
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0666 | IPC_CREAT);
-    m_pop.sem_num = 0;
-    semop(m_sm_mutex, &m_pop, 1); // wait on m_sm_mutex
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+    m_entry_lock(&m_SM[sockfd]);
 
     // check if the socket is valid
     if (m_SM[sockfd].is_free == 1)
     {
-        // signal m_sm_mutex
-        m_vop.sem_num = 0;
-        semop(m_sm_mutex, &m_vop, 1);
-        shmdt(m_SM);
+        m_unlock_entry(sockfd);
         errno = EBADF;
         return -1;
     }
+    return 0;
+}
 
-    // ----------------------------- Check if the send to address is valid bound address -----------------------------
+// Check that dest_addr is the peer the socket is bound to, called with the entry lock held
+// Returns 0 with the lock held, -1 with errno set (ENOTCONN) and the lock released
+int m_check_dest(int sockfd, const struct sockaddr *dest_addr)
+{
     if (strcmp(m_SM[sockfd].dest_ip, inet_ntoa(((struct sockaddr_in *)dest_addr)->sin_addr)) != 0 || m_SM[sockfd].dest_port != ntohs(((struct sockaddr_in *)dest_addr)->sin_port))
     {
-        // signal m_sm_mutex
-        m_vop.sem_num = 0;
-        semop(m_sm_mutex, &m_vop, 1);
-        // free resources
-        shmdt(m_SM);
+        m_unlock_entry(sockfd);
         errno = ENOTCONN;
         return -1;
     }
+    return 0;
+}
 
-    // ----------------------------- Check if there is space in the send buffer -----------------------------
-    int i;
-    for (i = 0; i < MAX_SEND_BUFFER_SIZE; i++)
+// Wait for a free send buffer entry until the deadline (see m_deadline), never with MSG_DONTWAIT
+// the next message then goes to entry SEND_SLOT(num_messages_sent + 1)
+// Called with the entry lock held; returns 0 with the lock held, -1 with errno set and the lock released
+int m_send_space(int sockfd, int flags, const struct timespec *deadline)
+{
+    // the entry of a reservation is only handed out once
+    if (m_SM[sockfd].send_reserved)
+    {
+        m_unlock_entry(sockfd);
+        errno = EBUSY;
+        return -1;
+    }
+    // the send buffer is full when it holds MAX_SEND_BUFFER_SIZE sequence numbers from the oldest unacknowledged message
+    while (m_SM[sockfd].num_messages_sent + 1 - m_SM[sockfd].swnd.base >= (uint32_t)MAX_SEND_BUFFER_SIZE)
     {
-        if (m_SM[sockfd].send_buffer[i][0] == '\0')
+        if (flags & MSG_DONTWAIT)
         {
-            break;
+            m_unlock_entry(sockfd);
+            errno = ENOBUFS;
+            return -1;
+        }
+        // its worker bumps send_event when an ACK frees an entry
+        if (m_wait_event(sockfd, &m_SM[sockfd].send_event, &m_SM[sockfd].send_waiters, deadline) < 0 || m_SM[sockfd].is_free == 1 || m_SM[sockfd].send_reserved)
+        {
+            int err = m_SM[sockfd].is_free == 1 ? EBADF : m_SM[sockfd].send_reserved ? EBUSY : errno;
+            m_unlock_entry(sockfd);
+            errno = err;
+            return -1;
         }
     }
+    return 0;
+}
+
+// Hand the message of len bytes in the next send buffer entry to the worker, called with the entry lock held
+void m_send_publish(int sockfd, size_t len)
+{
+    m_SM[sockfd].num_messages_sent++;
+    int i = SEND_SLOT(m_SM[sockfd].num_messages_sent);
+    m_SM[sockfd].send_len[i] = len;
+    m_SM[sockfd].send_tx_count[i] = 0;
+    m_SM[sockfd].send_queued_at[i] = m_now_us();
+    // a message of m_sendto or m_send_commit keeps its boundaries, m_write sets stream_tail again for its own
+    m_SM[sockfd].stream_tail = 0;
+    if (m_debug)
+        printf("[msocket.c] Message sent: %.*s\n", (int)len, m_SM[sockfd].send_buffer[i]);
+}
 
-    if (i >= MAX_SEND_BUFFER_SIZE)
+int m_sendto_timeout(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, int timeout_ms)
+{
+    // a message is 1 to MESSAGE_SIZE bytes, length 0 marks a free send buffer entry
+    if (len == 0 || len > MESSAGE_SIZE)
     {
+        errno = len == 0 ? EINVAL : EMSGSIZE;
+        return -1;
+    }
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
 
-        // signal m_sm_mutex
-        semop(m_sm_mutex, &m_vop, 1);
+    // ----------------------------- Check if the send to address is valid bound address -----------------------------
+    if (m_check_dest(sockfd, dest_addr) < 0)
+        return -1;
 
-        // free resources
-        shmdt(m_SM);
+    // ----------------------------- Wait for space in the send buffer -----------------------------
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (m_send_space(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline) < 0)
+        return -1;
+
+    // ----------------------------- Write the message to the sender side message buffer -----------------------------
+    memcpy(m_SM[sockfd].send_buffer[SEND_SLOT(m_SM[sockfd].num_messages_sent + 1)], buf, len);
+    m_send_publish(sockfd, len);
+    m_unlock_entry(sockfd);
+
+    // let its worker put the message on the wire right away
+    m_ring(sockfd);
+
+    return len;
+}
 
-        errno = ENOBUFS;
+void *m_send_reserve(int sockfd, int flags)
+{
+    return m_send_reserve_timeout(sockfd, flags, -1);
+}
+
+void *m_send_reserve_timeout(int sockfd, int flags, int timeout_ms)
+{
+    if (m_lock_entry(sockfd) < 0)
+        return NULL;
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (m_send_space(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline) < 0)
+        return NULL;
+
+    // the entry past num_messages_sent is not looked at by the worker until m_send_commit publishes it
+    m_SM[sockfd].send_reserved = 1;
+    void *slot = m_SM[sockfd].send_buffer[SEND_SLOT(m_SM[sockfd].num_messages_sent + 1)];
+    m_unlock_entry(sockfd);
+    return slot;
+}
+
+int m_send_commit(int sockfd, size_t len)
+{
+    if (len > MESSAGE_SIZE)
+    {
+        errno = EMSGSIZE;
         return -1;
     }
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    if (!m_SM[sockfd].send_reserved)
+    {
+        m_unlock_entry(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    m_SM[sockfd].send_reserved = 0;
+    // a commit of 0 bytes gives the entry back
+    if (len > 0)
+        m_send_publish(sockfd, len);
+    m_unlock_entry(sockfd);
 
-    // ----------------------------- Write the message to the sender side message buffer -----------------------------
-    memset(m_SM[sockfd].send_buffer[i], 0, MESSAGE_SIZE);
-    strncpy(m_SM[sockfd].send_buffer[i], (char *)buf, len);
-    m_SM[sockfd].num_messages_sent++;
-    m_SM[sockfd].send_seq_num[i] = m_SM[sockfd].num_messages_sent;
+    if (len > 0)
+        m_ring(sockfd);
+    return len;
+}
+
+// Wait for the next message in order, which is always in the entry of rwnd.base, until the deadline (see m_deadline)
+// Called with the entry lock held; returns its receive buffer entry with the lock held, -1 with errno set and the lock released
+int m_recv_message(int sockfd, int flags, const struct timespec *deadline)
+{
+    // the entry of a peeked message stays in place until m_recv_release
+    if (m_SM[sockfd].recv_peeked)
+    {
+        m_unlock_entry(sockfd);
+        errno = EBUSY;
+        return -1;
+    }
+    int slot = RECEIVE_SLOT(m_SM[sockfd].rwnd.base);
+    while (m_SM[sockfd].receive_len[slot] == 0)
+    {
+        if (flags & MSG_DONTWAIT)
+        {
+            m_unlock_entry(sockfd);
+            errno = ENOMSG;
+            return -1;
+        }
+        // its worker bumps receive_event when it stores a message in the receive buffer
+        if (m_wait_event(sockfd, &m_SM[sockfd].receive_event, &m_SM[sockfd].receive_waiters, deadline) < 0 || m_SM[sockfd].is_free == 1 || m_SM[sockfd].recv_peeked)
+        {
+            int err = m_SM[sockfd].is_free == 1 ? EBADF : m_SM[sockfd].recv_peeked ? EBUSY : errno;
+            m_unlock_entry(sockfd);
+            errno = err;
+            return -1;
+        }
+    }
+    return slot;
+}
+
+// Free the receive buffer entry of the message at rwnd.base, called with the entry lock held
+// Returns 1 if the worker has to advertise the freed entry (see m_doorbell)
+int m_recv_free(int sockfd)
+{
+    int slot = RECEIVE_SLOT(m_SM[sockfd].rwnd.base);
+    mtp_counters *c = &m_SM[sockfd].counters;
+    long long delay = m_now_us() - m_SM[sockfd].receive_time[slot];
+    c->msgs_delivered++;
+    c->bytes_delivered += m_SM[sockfd].receive_len[slot];
+    c->receive_delay += delay;
+    if (delay > c->receive_delay_max)
+        c->receive_delay_max = delay;
+    m_SM[sockfd].receive_len[slot] = 0;
+    m_SM[sockfd].recv_offset = 0;
+    m_SM[sockfd].rwnd.base++;
+    // the peer was told that the window is closed, have its worker advertise the freed entry
+    int window_update = m_SM[sockfd].rwnd.size == 0;
+    if (window_update)
+        m_SM[sockfd].window_update = 1;
+    m_SM[sockfd].rwnd.size++;
+    return window_update;
+}
+
+// Copy the message at rwnd.base into buf and free its entry, called with the entry lock held
+// the part that does not fit in len bytes is discarded as with UDP (so is the part m_read has consumed already)
+// Returns its length, window_update is set if the worker has to advertise the freed entry
+int m_recv_copy(int sockfd, void *buf, size_t len, int *window_update)
+{
+    int slot = RECEIVE_SLOT(m_SM[sockfd].rwnd.base);
+    int offset = m_SM[sockfd].recv_offset;
+    int n = m_SM[sockfd].receive_len[slot] - offset;
+    if ((size_t)n > len)
+        n = len;
+    memcpy(buf, m_SM[sockfd].receive_buffer[slot] + offset, n);
     if (m_debug)
-        printf("[msocket.c] Message sent: %s\n", m_SM[sockfd].send_buffer[i]);
-    // signal m_sm_mutex
-    m_vop.sem_num = 0;
-    semop(m_sm_mutex, &m_vop, 1);
+        printf("[msocket.c] Message received: %.*s\n", n, (char *)buf);
+    *window_update |= m_recv_free(sockfd);
+    return n;
+}
 
-    // free resources
-    shmdt(m_SM);
+int m_recvfrom_timeout(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen, int timeout_ms)
+{
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    int slot = m_recv_message(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline);
+    if (slot < 0)
+        return -1;
+
+    int window_update = 0;
+    int n = m_recv_copy(sockfd, buf, len, &window_update);
+    m_unlock_entry(sockfd);
+
+    if (window_update)
+        m_ring(sockfd);
+
+    return n;
+}
+
+const void *m_recv_peek(int sockfd, size_t *len, int flags)
+{
+    return m_recv_peek_timeout(sockfd, len, flags, -1);
+}
+
+const void *m_recv_peek_timeout(int sockfd, size_t *len, int flags, int timeout_ms)
+{
+    if (m_lock_entry(sockfd) < 0)
+        return NULL;
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    int slot = m_recv_message(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline);
+    if (slot < 0)
+        return NULL;
+
+    // the worker only stores messages in free entries, this one stays as it is until m_recv_release
+    m_SM[sockfd].recv_peeked = 1;
+    *len = m_SM[sockfd].receive_len[slot] - m_SM[sockfd].recv_offset;
+    const void *message = m_SM[sockfd].receive_buffer[slot] + m_SM[sockfd].recv_offset;
+    m_unlock_entry(sockfd);
+    return message;
+}
+
+int m_recv_release(int sockfd)
+{
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    if (!m_SM[sockfd].recv_peeked)
+    {
+        m_unlock_entry(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    m_SM[sockfd].recv_peeked = 0;
+    int window_update = m_recv_free(sockfd);
+    m_unlock_entry(sockfd);
 
+    if (window_update)
+        m_ring(sockfd);
     return 0;
 }
 
-int m_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+int m_write(int sockfd, const void *buf, size_t len, int flags)
+{
+    return m_write_timeout(sockfd, buf, len, flags, -1);
+}
+
+int m_read(int sockfd, void *buf, size_t len, int flags)
+{
+    return m_read_timeout(sockfd, buf, len, flags, -1);
+}
+
+int m_write_timeout(int sockfd, const void *buf, size_t len, int flags, int timeout_ms)
 {
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS)
+    if (len > INT_MAX)
+        len = INT_MAX;
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    if (len == 0)
     {
-        errno = EBADF;
+        m_unlock_entry(sockfd);
+        return 0;
+    }
+
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (timeout_ms == 0)
+        flags |= MSG_DONTWAIT;
+    size_t done = 0;
+    int published = 0;
+    while (done < len)
+    {
+        // top up the last message while the worker has not sent it, so that small writes share segments,
+        // but only a message of m_write: the boundaries of the messages of m_sendto are kept
+        uint32_t last = m_SM[sockfd].num_messages_sent;
+        int j = SEND_SLOT(last);
+        if (m_SM[sockfd].stream_tail && SEQ_GEQ(last, m_SM[sockfd].swnd.next) && m_SM[sockfd].send_len[j] < MESSAGE_SIZE && !m_SM[sockfd].send_reserved)
+        {
+            size_t n = MESSAGE_SIZE - m_SM[sockfd].send_len[j];
+            if (n > len - done)
+                n = len - done;
+            memcpy(m_SM[sockfd].send_buffer[j] + m_SM[sockfd].send_len[j], (const char *)buf + done, n);
+            m_SM[sockfd].send_len[j] += n;
+            done += n;
+            continue;
+        }
+
+        // start sending what is written before waiting for room for the rest
+        if (published && m_SM[sockfd].num_messages_sent + 1 - m_SM[sockfd].swnd.base >= (uint32_t)MAX_SEND_BUFFER_SIZE)
+        {
+            m_doorbell(m_ctrl, sockfd);
+            published = 0;
+        }
+        if (m_send_space(sockfd, flags, deadline) < 0)
+        {
+            // the lock is released, report the bytes written if there are any
+            if (done == 0)
+                return -1;
+            m_ring(sockfd);
+            return done;
+        }
+
+        // a new segment of at most MESSAGE_SIZE bytes
+        size_t n = len - done < MESSAGE_SIZE ? len - done : MESSAGE_SIZE;
+        memcpy(m_SM[sockfd].send_buffer[SEND_SLOT(m_SM[sockfd].num_messages_sent + 1)], (const char *)buf + done, n);
+        m_send_publish(sockfd, n);
+        m_SM[sockfd].stream_tail = 1;
+        done += n;
+        published = 1;
+    }
+    m_unlock_entry(sockfd);
+
+    m_ring(sockfd);
+    return done;
+}
+
+int m_read_timeout(int sockfd, void *buf, size_t len, int flags, int timeout_ms)
+{
+    if (len > INT_MAX)
+        len = INT_MAX;
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    // wait for at least one byte
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (m_recv_message(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline) < 0)
         return -1;
+
+    // then take what is there, across the boundaries of the messages
+    size_t done = 0;
+    int window_update = 0;
+    while (done < len)
+    {
+        int slot = RECEIVE_SLOT(m_SM[sockfd].rwnd.base);
+        if (m_SM[sockfd].receive_len[slot] == 0)
+            break;
+        size_t n = m_SM[sockfd].receive_len[slot] - m_SM[sockfd].recv_offset;
+        if (n > len - done)
+            n = len - done;
+        memcpy((char *)buf + done, m_SM[sockfd].receive_buffer[slot] + m_SM[sockfd].recv_offset, n);
+        done += n;
+        m_SM[sockfd].recv_offset += n;
+        if (m_SM[sockfd].recv_offset == m_SM[sockfd].receive_len[slot])
+            window_update |= m_recv_free(sockfd);
     }
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0666 | IPC_CREAT);
-    m_pop.sem_num = 0;
-    semop(m_sm_mutex, &m_pop, 1); // wait on m_sm_mutex
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+    m_unlock_entry(sockfd);
 
-    // check if the socket is valid
-    if (m_SM[sockfd].is_free == 1)
+    if (window_update)
+        m_ring(sockfd);
+    return done;
+}
+
+int m_sendto_batch(int sockfd, const mtp_msg *msgs, int n, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    return m_sendto_batch_timeout(sockfd, msgs, n, flags, dest_addr, addrlen, -1);
+}
+
+int m_recvfrom_batch(int sockfd, mtp_msg *msgs, int n, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    return m_recvfrom_batch_timeout(sockfd, msgs, n, flags, src_addr, addrlen, -1);
+}
+
+int m_sendto_batch_timeout(int sockfd, const mtp_msg *msgs, int n, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, int timeout_ms)
+{
+    if (n <= 0)
     {
-        // signal m_sm_mutex
-        m_vop.sem_num = 0;
-        semop(m_sm_mutex, &m_vop, 1);
-        shmdt(m_SM);
-        errno = EBADF;
+        errno = EINVAL;
         return -1;
     }
+    // the whole batch is checked before anything is queued
+    for (int k = 0; k < n; k++)
+    {
+        if (msgs[k].len == 0 || msgs[k].len > MESSAGE_SIZE)
+        {
+            errno = msgs[k].len == 0 ? EINVAL : EMSGSIZE;
+            return -1;
+        }
+    }
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    if (m_check_dest(sockfd, dest_addr) < 0)
+        return -1;
 
-    // find the minimum sequence number in the receive buffer
-    int min_seq_num = 1e9;
-    int max_seq_num = -1;
-    int min_seq_num_index = -1;
-    for (int i = 0; i < MAX_RECEIVE_BUFFER_SIZE; i++)
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (timeout_ms == 0)
+        flags |= MSG_DONTWAIT;
+    int done = 0, published = 0;
+    while (done < n)
     {
-        if (m_SM[sockfd].receive_seq_num[i] < min_seq_num)
+        // start sending what is queued before waiting for room for the rest
+        if (published && m_SM[sockfd].num_messages_sent + 1 - m_SM[sockfd].swnd.base >= (uint32_t)MAX_SEND_BUFFER_SIZE)
         {
-            min_seq_num = m_SM[sockfd].receive_seq_num[i];
-            min_seq_num_index = i;
+            m_doorbell(m_ctrl, sockfd);
+            published = 0;
         }
-        if (m_SM[sockfd].receive_seq_num[i] > max_seq_num)
+        if (m_send_space(sockfd, flags, deadline) < 0)
         {
-            max_seq_num = m_SM[sockfd].receive_seq_num[i];
+            // the lock is released, report the messages queued if there are any
+            if (done == 0)
+                return -1;
+            m_ring(sockfd);
+            return done;
         }
+        memcpy(m_SM[sockfd].send_buffer[SEND_SLOT(m_SM[sockfd].num_messages_sent + 1)], msgs[done].buf, msgs[done].len);
+        m_send_publish(sockfd, msgs[done].len);
+        done++;
+        published = 1;
     }
-    if (m_SM[sockfd].receive_buffer[min_seq_num_index][0] == '\0')
+    m_unlock_entry(sockfd);
+
+    m_ring(sockfd);
+    return done;
+}
+
+int m_recvfrom_batch_timeout(int sockfd, mtp_msg *msgs, int n, int flags, struct sockaddr *src_addr, socklen_t *addrlen, int timeout_ms)
+{
+    if (n <= 0)
     {
-        // signal m_sm_mutex
-        m_vop.sem_num = 0;
-        semop(m_sm_mutex, &m_vop, 1);
-        errno = ENOMSG;
+        errno = EINVAL;
         return -1;
     }
+    if (m_lock_entry(sockfd) < 0)
+        return -1;
+    // wait for the first message only
+    struct timespec ts, *deadline = m_deadline(timeout_ms, &ts);
+    if (m_recv_message(sockfd, timeout_ms == 0 ? flags | MSG_DONTWAIT : flags, deadline) < 0)
+        return -1;
 
-    // copy the message and send message
-    // memset((char *)buf, 0, MESSAGE_SIZE);
-    strncpy((char *)buf, m_SM[sockfd].receive_buffer[min_seq_num_index], MESSAGE_SIZE);
-    memset(m_SM[sockfd].receive_buffer[min_seq_num_index], 0, MESSAGE_SIZE);
-    m_SM[sockfd].receive_seq_num[min_seq_num_index] = max_seq_num + 1;
-    if (m_debug)
-        printf("[msocket.c] Message received: %s\n", (char *)buf);
-    // signal m_sm_mutex
-    m_vop.sem_num = 0;
-    semop(m_sm_mutex, &m_vop, 1);
-    // free resources
-    shmdt(m_SM);
+    int done = 0, window_update = 0;
+    while (done < n && m_SM[sockfd].receive_len[RECEIVE_SLOT(m_SM[sockfd].rwnd.base)] != 0)
+    {
+        msgs[done].msg_len = m_recv_copy(sockfd, msgs[done].buf, msgs[done].len, &window_update);
+        done++;
+    }
+    m_unlock_entry(sockfd);
 
-    return MESSAGE_SIZE;
+    if (window_update)
+        m_ring(sockfd);
+    return done;
 }
 
 int m_close(int sockfd)
 {
     // ----------------------------- Find the corresponding actual UDP socket id from the m_SM table -----------------------------
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0666 | IPC_CREAT);
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS)
+    if (m_init() < 0)
+        return -1;
+    if (sockfd < 0 || sockfd >= m_ctrl->max_sockets)
     {
         errno = EBADF;
         return -1;
     }
-    // wait on m_sm_mutex
-    semop(m_sm_mutex, &m_pop, 1);
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+    // lock the table, then the entry
+    m_mutex_lock(&m_ctrl->table_lock);
+    m_entry_lock(&m_SM[sockfd]);
 
     int udp_sock = m_SM[sockfd].udp_sock;
     // if the UDP socket ID is 0, then it is not initialized
     if (udp_sock == 0 || udp_sock == -1)
     {
 
-        // signal m_sm_mutex
-        semop(m_sm_mutex, &m_vop, 1);
-
-        // free resources
-        shmdt(m_SM);
+        m_entry_unlock(&m_SM[sockfd]);
+        m_mutex_unlock(&m_ctrl->table_lock);
         errno = ENOTSOCK;
 
         return -1;
     }
-    // signal m_sm_mutex
-    semop(m_sm_mutex, &m_vop, 1);
-    // mark the entry as free
+    // mark the entry as free and wake up callers blocked on it
     m_SM[sockfd].is_free = 1;
-    // free resources
-    shmdt(m_SM);
+    m_SM[sockfd].udp_sock = 0;
+    m_SM[sockfd].send_event++;
+    m_SM[sockfd].receive_event++;
+    m_futex_wake(&m_SM[sockfd].send_event);
+    m_futex_wake(&m_SM[sockfd].receive_event);
+
+    m_entry_unlock(&m_SM[sockfd]);
+    m_table_release(m_ctrl, sockfd);
+    m_mutex_unlock(&m_ctrl->table_lock);
+
+    // ----------------------------- Release the UDP socket via initmsocket.c -----------------------------
+    // its worker stops watching it, the socket is not touched any more as the entry is free
+    // (the UDP socket is only closed by this request, so a new socket in the entry never has the same one)
+    m_request(MTP_OP_CLOSE, udp_sock, sockfd, NULL, 0);
 
     return 0;
 }
 
-void prinfo()
+int m_setcc(int sockfd, const char *name)
 {
-    pid_t pid = getpid();
-    int i;
+    int algo = mtp_cc_find(name);
+    if (algo < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (m_init() < 0)
+        return -1;
+    if (sockfd < 0 || sockfd >= m_ctrl->max_sockets)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    m_entry_lock(&m_SM[sockfd]);
+    if (m_SM[sockfd].is_free == 1)
+    {
+        m_entry_unlock(&m_SM[sockfd]);
+        errno = EBADF;
+        return -1;
+    }
+    m_SM[sockfd].cc.algo = algo;
+    mtp_cc_algos[algo]->init(&m_SM[sockfd].cc);
+    m_entry_unlock(&m_SM[sockfd]);
+    return 0;
+}
 
-    m_sm_mutex = semget(ftok("initmsocket.c", MTP_SOCKET_MUTEX_KEY), 1, 0666 | IPC_CREAT);
-    m_sm_shmid = shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), sizeof(mtp_socket) * MAX_SOCKETS, 0);
-    m_SM = (mtp_socket *)shmat(m_sm_shmid, (void *)0, 0);
+// ------------------------------------------ Statistics ------------------------------------------
+#define M_STATS_RETRIES 1000
 
-    m_pop.sem_num = 0;
-    semop(m_sm_mutex, &m_pop, 1); // wait on m_sm_mutex
-    for (i = 0; i < MAX_SOCKETS; i++)
+// Copy the snapshot of entry sockfd into stats, without the entry lock (see m_entry_lock)
+// Returns 0 on success, -1 with errno set otherwise
+int m_read_stats(int sockfd, mtp_stats *stats)
+{
+    mtp_socket *e = &m_SM[sockfd];
+    for (int tries = 0; tries < M_STATS_RETRIES; tries++)
     {
-        if (m_SM[i].is_free == 0 && m_SM[i].pid == pid)
+        unsigned int seq = __atomic_load_n(&e->stats_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
         {
-            if (m_debug) {
-                printf("Socket ID: %d\n", i);
-                printf("UDP Socket ID: %d\n", m_SM[i].udp_sock);
-                printf("Source IP: %s\n", m_SM[i].source_ip);
-                printf("Source Port: %d\n", m_SM[i].source_port);
-                printf("Destination IP: %s\n", m_SM[i].dest_ip);
-                printf("Destination Port: %d\n", m_SM[i].dest_port);
-                printf("\n");
-            }
+            // a holder of the lock is writing, let it run
+            sched_yield();
+            continue;
         }
+        int is_free = e->is_free;
+        stats->sockfd = sockfd;
+        stats->pid = e->pid;
+        memcpy(stats->source_ip, e->source_ip, sizeof(stats->source_ip));
+        stats->source_port = e->source_port;
+        memcpy(stats->dest_ip, e->dest_ip, sizeof(stats->dest_ip));
+        stats->dest_port = e->dest_port;
+        stats->cc_algo = e->cc.algo;
+        stats->cwnd = e->cc.cwnd;
+        stats->ssthresh = e->cc.ssthresh;
+        stats->cc_losses = e->cc.losses;
+        stats->srtt = e->srtt;
+        stats->rttvar = e->rttvar;
+        stats->rto = e->rto;
+        stats->peer_window = e->swnd.size;
+        stats->in_flight = (int)(e->swnd.next - e->swnd.base);
+        stats->send_queued = (int)(e->num_messages_sent + 1 - e->swnd.next);
+        stats->receive_queued = MAX_RECEIVE_BUFFER_SIZE - e->rwnd.size;
+        stats->receive_window = e->rwnd.size;
+        stats->counters = e->counters;
+        // the copy only counts if no holder of the lock started writing meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->stats_seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (is_free == 1)
+        {
+            errno = EBADF;
+            return -1;
+        }
+        // the strings are copied racily, a torn one is only ever cut short
+        stats->source_ip[sizeof(stats->source_ip) - 1] = '\0';
+        stats->dest_ip[sizeof(stats->dest_ip) - 1] = '\0';
+        if (stats->cc_algo < 0 || stats->cc_algo >= CC_COUNT)
+            stats->cc_algo = CC_RENO;
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int m_getstats(int sockfd, mtp_stats *stats)
+{
+    if (m_init() < 0)
+        return -1;
+    if (sockfd < 0 || sockfd >= m_ctrl->max_sockets)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return m_read_stats(sockfd, stats);
+}
+
+int m_getstats_all(mtp_stats *stats, int n)
+{
+    if (m_init() < 0)
+        return -1;
+    // the list of entries in use is walked without table_lock (see m_table_active), a socket released meanwhile is skipped
+    int *active = m_table_active(m_ctrl);
+    int count = __atomic_load_n(&m_ctrl->active_count, __ATOMIC_ACQUIRE);
+    int found = 0;
+    mtp_stats spare;
+    for (int k = 0; k < count; k++)
+    {
+        int i = __atomic_load_n(&active[k], __ATOMIC_RELAXED);
+        if (i < 0 || i >= m_ctrl->max_sockets)
+            continue;
+        if (m_read_stats(i, found < n ? &stats[found] : &spare) == 0)
+            found++;
+    }
+    return found;
+}
+
+void prinfo()
+{
+    pid_t pid = getpid();
+
+    if (m_init() < 0 || !m_debug)
+        return;
+    mtp_stats *stats = malloc(sizeof(mtp_stats) * m_ctrl->max_sockets);
+    if (stats == NULL)
+        return;
+    int count = m_getstats_all(stats, m_ctrl->max_sockets);
+    for (int k = 0; k < count && k < m_ctrl->max_sockets; k++)
+    {
+        mtp_stats *st = &stats[k];
+        if (st->pid != pid)
+            continue;
+        printf("Socket ID: %d\n", st->sockfd);
+        printf("Source IP: %s\n", st->source_ip);
+        printf("Source Port: %d\n", st->source_port);
+        printf("Destination IP: %s\n", st->dest_ip);
+        printf("Destination Port: %d\n", st->dest_port);
+        printf("Messages sent: %lld (%lld bytes), received: %lld (%lld bytes), delivered: %lld\n", st->counters.msgs_sent, st->counters.bytes_sent, st->counters.msgs_received, st->counters.bytes_received, st->counters.msgs_delivered);
+        printf("Retransmissions: %lld (fast: %lld, timeouts: %lld), window probes: %lld\n", st->counters.retransmissions, st->counters.fast_retransmissions, st->counters.timeouts, st->counters.window_probes);
+        printf("Congestion control: %s, cwnd: %.1f, ssthresh: %.1f, reductions: %d\n", mtp_cc_algos[st->cc_algo]->name, st->cwnd, st->ssthresh, st->cc_losses);
+        printf("SRTT: %lld us, RTTVAR: %lld us, RTO: %d ms\n", st->srtt, st->rttvar, st->rto);
+        printf("\n");
     }
-    m_vop.sem_num = 0;
-    semop(m_sm_mutex, &m_vop, 1); // signal m_sm_mutex
-    shmdt(m_SM);
+    free(stats);
     return;
 }
 
@@ -17,6 +17,10 @@
 #include <signal.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -24,107 +28,482 @@
 #include <sys/time.h>
 #include <sys/ipc.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
+#include <mtp_cc.h>
+
+// Window size in messages, can be set at build time (make WINDOW=64)
+// The receive buffer holds one window and the send buffer two
+#ifndef MAX_WINDOW_SIZE
+#define MAX_WINDOW_SIZE 5
+#endif
+#if MAX_WINDOW_SIZE < 1 || MAX_WINDOW_SIZE > 65535
+#error "MAX_WINDOW_SIZE must fit the 16-bit window field of the header"
+#endif
+
+// Default size of the MTP socket table, initmsocket -n sets it at startup
 #define MAX_SOCKETS 25
-#define MAX_SEND_BUFFER_SIZE 10
-#define MAX_RECEIVE_BUFFER_SIZE 5
+#define MAX_SEND_BUFFER_SIZE (2 * MAX_WINDOW_SIZE)
+#define MAX_RECEIVE_BUFFER_SIZE MAX_WINDOW_SIZE
+
+// Sequence numbers are 32-bit and wrap around: they are kept in uint32_t and compared as serial numbers (RFC 1982),
+// a before b if (int32_t)(a - b) < 0, which holds as long as the messages compared are less than 2^31 apart
+#define SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b) SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
+
+// The send and receive buffers are rings of a power of 2 entries, the smallest holding MAX_SEND_BUFFER_SIZE and
+// MAX_RECEIVE_BUFFER_SIZE messages, so that message seq keeps its entry (seq & (size - 1)) when the sequence numbers
+// wrap around 2^32; at most MAX_*_BUFFER_SIZE consecutive entries are in use at a time
+#define MTP_SMEAR1(v) ((v) | (v) >> 1)
+#define MTP_SMEAR2(v) (MTP_SMEAR1(v) | MTP_SMEAR1(v) >> 2)
+#define MTP_SMEAR4(v) (MTP_SMEAR2(v) | MTP_SMEAR2(v) >> 4)
+#define MTP_SMEAR8(v) (MTP_SMEAR4(v) | MTP_SMEAR4(v) >> 8)
+#define MTP_POW2(n) ((MTP_SMEAR8((n) - 1) | MTP_SMEAR8((n) - 1) >> 16) + 1)
+#define SEND_RING_SIZE MTP_POW2(MAX_SEND_BUFFER_SIZE)
+#define RECEIVE_RING_SIZE MTP_POW2(MAX_RECEIVE_BUFFER_SIZE)
+#define SEND_SLOT(seq) ((uint32_t)(seq) & (SEND_RING_SIZE - 1))
+#define RECEIVE_SLOT(seq) ((uint32_t)(seq) & (RECEIVE_RING_SIZE - 1))
 #define MESSAGE_SIZE 1024
-#define MESSAGE_HEADER_SIZE 1
-#define SEQ_NUM_SIZE 4
+#define MESSAGE_HEADER_SIZE 16
+#define SACK_BITMAP_SIZE 32 // bytes of SACK bitmap in an ACK, covers 256 messages after the cumulative ACK
 #define GARBAGE_COLLECTOR_INTERVAL 5
 
-#define MAX_WINDOW_SIZE 5
-
 // MTP socket type
 #define SOCK_MTP 7
 
-// Timeout in seconds
+// Interval of the periodic window updates sent by R, in seconds
 #define T 5
 
+// Retransmission timeout in ms: initial value, and default bounds of the adaptive RTO (initmsocket -m / -M)
+#define RTO_INITIAL 1000
+#define RTO_MIN 5
+#define RTO_MAX 60000
+
+// Duplicate ACKs that trigger a fast retransmission of the oldest unacknowledged message (initmsocket -d)
+#define DUP_ACK_THRESHOLD 3
+
 // Probability of dropping a message
 #define P 0.0
 
+// MTP wire header, sent in network byte order in front of every datagram
+#define MTP_VERSION 1
+#define MTP_FLAG_ACK 0x01
+typedef struct mtp_header
+{
+    uint8_t version;   // MTP_VERSION, datagrams of other versions are dropped
+    uint8_t flags;     // MTP_FLAG_ACK for acknowledgements
+    uint16_t window;   // free entries in the receive buffer of the sender of the datagram
+    uint32_t seq;      // sequence number of a data message; in an ACK the message that triggered it, 0 if none
+    uint32_t ack;      // cumulative ACK: every message up to ack has been received
+    uint16_t len;      // payload length in bytes, the payload of an ACK is its SACK bitmap
+    uint16_t reserved; // 0
+} mtp_header;
+_Static_assert(sizeof(mtp_header) == MESSAGE_HEADER_SIZE, "mtp_header must not be padded");
+
 // Structure for sender window
+// The send buffer is a ring: message seq lives in entry SEND_SLOT(seq),
+// the buffer holds the messages base .. num_messages_sent and the window is base .. base + size - 1
 typedef struct swnd
 {
-    int size;
-    int sequence_numbers[MAX_WINDOW_SIZE];
+    int size;      // window advertised by the receiver
+    uint32_t base; // oldest unacknowledged message
+    uint32_t next; // next message to transmit for the first time
 } swnd;
 
 // Structure for receiver window
+// The receive buffer is a ring: message seq lives in entry RECEIVE_SLOT(seq),
+// messages base .. base + MAX_RECEIVE_BUFFER_SIZE - 1 are accepted, possibly out of order
 typedef struct rwnd
 {
-    int size;
-    int sequence_numbers[MAX_WINDOW_SIZE];
+    int size;      // number of free entries, advertised to the sender
+    uint32_t base; // next message to deliver to m_recvfrom
+    uint32_t next; // first message not received yet, the cumulative ACK is next - 1
 } rwnd;
 
+// Structure for the counters of an MTP socket since it was created, kept in its entry by its worker and by the m_*
+// calls under the entry lock
+typedef struct mtp_counters
+{
+    long long msgs_sent;        // data messages transmitted for the first time
+    long long bytes_sent;       // their payload bytes
+    long long msgs_received;    // data messages stored in the receive buffer, duplicates excluded
+    long long bytes_received;
+    long long msgs_delivered;   // messages handed to the application (by m_read once read in full)
+    long long bytes_delivered;
+    long long acks_sent;        // ACKs, window updates included
+    long long acks_received;
+    long long dup_acks;         // ACKs that acknowledged nothing new, window updates excluded
+    long long retransmissions;  // messages retransmitted on a timeout or by fast retransmit
+    long long fast_retransmissions; // retransmissions triggered by duplicate ACKs instead of a timeout
+    long long timeouts;         // expiries of the retransmission timer of the oldest message (RTO backoffs)
+    long long window_probes;    // messages sent by the persist timer while the peer window was closed
+    long long duplicates;       // data messages received again
+    long long out_of_window;    // data messages past the receive buffer, dropped and acknowledged with the current window
+    long long drops;            // datagrams dropped by the emulated loss (-p), the bottleneck (-r) or as invalid
+    long long rtt_samples;      // RTT samples taken (Karn's rule)
+    long long min_rtt;          // smallest RTT sample in us, 0 if none
+    long long send_delay;       // total time in us the messages sent waited in the send buffer before their first transmission
+    long long send_delay_max;
+    long long receive_delay;    // total time in us the messages delivered waited in the receive buffer
+    long long receive_delay_max;
+} mtp_counters;
+
 // Structure for MTP socket
+// Each entry is guarded by its own lock, so operations on different sockets never
+// contend. The table lock in mtp_control only serializes slot allocation and
+// release (changes to is_free), which also take the entry lock.
 typedef struct mtp_socket
 {
+    pthread_mutex_t lock; // robust process-shared mutex, see m_mutex_lock
     int is_free;
     int pid;
+    unsigned long long pid_start; // start time of process pid (m_process_start), tells it from a later one with its pid
     int udp_sock;
     char source_ip[16];
     int source_port;
     char dest_ip[16];
     int dest_port;
-    char send_buffer[MAX_SEND_BUFFER_SIZE][MESSAGE_SIZE];
-    int send_seq_num[MAX_SEND_BUFFER_SIZE];
-    char receive_buffer[MAX_RECEIVE_BUFFER_SIZE][MESSAGE_SIZE];
-    int receive_seq_num[MAX_RECEIVE_BUFFER_SIZE];
+    char send_buffer[SEND_RING_SIZE][MESSAGE_SIZE];
+    int send_len[SEND_RING_SIZE]; // length of each message in bytes, 0 for a free entry
+    int send_tx_count[SEND_RING_SIZE]; // number of times each message has been transmitted
+    long long send_time[SEND_RING_SIZE]; // time of the last transmission of each message, CLOCK_MONOTONIC us
+    char receive_buffer[RECEIVE_RING_SIZE][MESSAGE_SIZE];
+    int receive_len[RECEIVE_RING_SIZE]; // length of each message in bytes, 0 for a free entry
     swnd swnd;
     rwnd rwnd;
-    int num_messages_sent;
+    uint32_t num_messages_sent; // sequence number of the last message written by m_sendto
+    int send_event;       // futex, bumped by its worker when an ACK frees a send buffer entry
+    int send_waiters;     // number of m_sendto calls sleeping on send_event
+    int receive_event;    // futex, bumped by its worker when a message is stored in the receive buffer
+    int receive_waiters;  // number of m_recvfrom calls sleeping on receive_event
+    int window_update;    // set by m_recvfrom when it frees space in a closed receive window, its worker then sends a window update
+    int send_reserved;    // set between m_send_reserve and m_send_commit, the reserved entry is SEND_SLOT(num_messages_sent + 1)
+    int recv_peeked;      // set between m_recv_peek and m_recv_release, the peeked entry is RECEIVE_SLOT(rwnd.base)
+    int recv_offset;      // bytes of the message at rwnd.base consumed by m_read
+    int stream_tail;      // set while the last message of the send buffer was written by m_write, which may top it up
+    long long srtt;       // smoothed round trip time in us, 0 until the first sample
+    long long rttvar;     // round trip time variation in us
+    int rto;              // retransmission timeout in ms
+    int rto_backoff;      // set while rto is backed off after a timeout of the message at rto_backoff_base
+    uint32_t rto_backoff_base; // window base at the last backoff
+    int dup_acks;         // duplicate ACKs received since the window base last moved
+    int in_recovery;      // set from a loss (fast retransmit or timeout) until the messages up to recover are acknowledged
+    uint32_t recover;     // recovery point, the last message sent when the recovery started
+    int persist;          // interval of the persist timer in ms while the peer window is closed with messages to send, 0 otherwise
+    mtp_cc cc;            // congestion control, its worker sends at most min(swnd.size, cc.cwnd) messages from swnd.base
+    unsigned int stats_seq; // odd while the entry lock is held, m_getstats reads the entry without the lock (seqlock)
+    mtp_counters counters;
+    long long send_queued_at[SEND_RING_SIZE]; // time each message was handed to the send buffer, CLOCK_MONOTONIC us
+    long long receive_time[RECEIVE_RING_SIZE]; // time each message was stored in the receive buffer, CLOCK_MONOTONIC us
 } mtp_socket;
 
-// Structure for shared memory
-typedef struct sock_info
+// Structure for a snapshot of an MTP socket taken by m_getstats
+typedef struct mtp_stats
 {
-    int sock_id;
+    int sockfd;
+    int pid;
+    char source_ip[16];
+    int source_port;
+    char dest_ip[16];
+    int dest_port;
+    int cc_algo;          // index in mtp_cc_algos
+    double cwnd;          // congestion window in messages
+    double ssthresh;
+    int cc_losses;        // window reductions
+    long long srtt;       // smoothed round trip time in us, 0 until the first sample
+    long long rttvar;
+    int rto;              // retransmission timeout in ms
+    int peer_window;      // window advertised by the peer
+    int in_flight;        // messages sent and not acknowledged
+    int send_queued;      // messages in the send buffer not sent yet
+    int receive_queued;   // messages in the receive buffer, out of order ones included
+    int receive_window;   // free entries of the receive buffer, advertised to the peer
+    mtp_counters counters;
+} mtp_stats;
+
+// Structure for the daemon control block, shared by initmsocket and the applications
+// The segment continues with the allocator of the MTP socket table (see m_table_alloc), guarded by table_lock,
+// and with the sockets that have work for each worker (see m_doorbell), set and cleared atomically.
+// Entry i belongs to worker i % workers, as entry k = i / workers of its shard of shard = (max_sockets + workers - 1) / workers:
+//   uint64_t summary[(max_sockets + 4095) / 4096]       - bit w set if word w of the free bitmap has a free entry
+//   uint64_t free_map[(max_sockets + 63) / 64]          - bit i set if entry i is free
+//   per worker:
+//     uint64_t ready_summary[(shard + 4095) / 4096]     - bit w set if word w of the ready bitmap may be non zero
+//     uint64_t ready_map[(shard + 63) / 64]             - bit k set if the worker has to look at entry k of its shard
+//   int active[max_sockets]                             - the entries in use, in active[0 .. active_count - 1]
+//   int active_pos[max_sockets]                         - position of entry i in active
+#define MTP_MAX_WORKERS 64
+
+// Requests to initmsocket
+#define MTP_OP_SOCKET 0 // create a UDP socket, returned in sock_id
+#define MTP_OP_BIND 1   // bind UDP socket sock_id of MTP socket mtp_id to IP:port and hand it to its worker
+#define MTP_OP_CLOSE 2  // release UDP socket sock_id
+
+#define MTP_REQUEST_RING 64  // slots of the request ring, a power of 2
+#define MTP_REQUEST_BATCH 16 // requests m_socket_batch has in the ring at a time
+
+// Structure for a request to initmsocket and its answer, a slot of the request ring in mtp_control (see m_request_claim)
+typedef struct mtp_request
+{
+    unsigned int seq; // turn of the slot
+    int pid;          // process of the requester, 0 while the slot is free
+    unsigned long long pid_start; // start time of process pid, stored before pid
+    int op;           // MTP_OP_SOCKET, MTP_OP_BIND or MTP_OP_CLOSE
+    int sock_id;      // UDP socket, -1 in the answer on failure
+    int mtp_id;
     char IP[16];
     int port;
-    int err_no;
-} SOCK_INFO;
+    int err_no; // error of a failed request
+    int done;   // set with the answer, the requester sleeps on it
+} mtp_request;
+
+// Structure for the state of a worker thread of initmsocket that applications look at, one cache line each
+typedef struct mtp_worker_state
+{
+    int sleeping; // set while the worker waits in epoll_wait, so that ringers only send a wakeup datagram when needed
+    char pad[60];
+} mtp_worker_state;
+
+typedef struct mtp_control
+{
+    int max_sockets;  // size of the MTP socket table
+    int workers;      // number of worker threads, each owns the MTP sockets i with i % workers == its index
+    int active_count; // number of entries in use
+    pthread_mutex_t table_lock; // serializes the allocation and release of entries
+    mtp_worker_state worker[MTP_MAX_WORKERS];
+    unsigned int request_head; // position of the next request initmsocket answers
+    unsigned int request_tail; // position the next requester claims
+    int request_event;         // bumped for every request published, initmsocket sleeps on it
+    int pad;
+    mtp_request request[MTP_REQUEST_RING];
+    uint64_t table[]; // allocator, see above
+} mtp_control;
+
+// Structure for one message of m_sendto_batch and m_recvfrom_batch
+typedef struct mtp_msg
+{
+    void *buf;   // the message to send, or the buffer to receive it in
+    size_t len;  // length of the message, or size of the buffer
+    int msg_len; // set by m_recvfrom_batch to the length of the message received
+} mtp_msg;
 
 // Shared Memory keys
-#define SOCK_INFO_KEY 65
-#define SOCK_INFO_MUTEX_KEY 66
 #define MTP_SOCKET_KEY 67
-#define MTP_SOCKET_MUTEX_KEY 68
-#define INIT_COMM_MUTEX_KEY 69
+#define MTP_CONTROL_KEY 71
 
 // Utility functions
 
+// Function to attach the process to the MTP daemon (initmsocket)
+// Called implicitly by the first m_* call, calling it again is a no-op
+// Returns 0 on success, -1 on failure (ENOENT if initmsocket is not running)
+int m_init();
+
+// Function to detach the process from the MTP daemon
+// Registered with atexit() by m_init, so explicit calls are optional
+void m_fini();
+
+// Function to run the protocol engine inside the process instead of using initmsocket, with a table of `sockets`
+// MTP sockets served by `threads` worker threads (see mtp_engine.h); the m_* calls then work on the sockets of the process,
+// whose UDP sockets it owns, and no message or request goes through System V IPC. Must be called before any other
+// m_* call, the engine runs until the process exits and is not inherited by fork()
+// Returns 0 on success, -1 on failure (EISCONN if the process already uses initmsocket or an engine)
+// Linked from mtp_engine.o, which comes with libmsocket.a
+int m_embed(int sockets, int threads);
+
+// Functions for m_embed to attach the process to the table and control block of its engine, whose requests are
+// carried out by handler in the thread that makes them, and whose idle workers have their work done by kick
+// m_engine_claim takes the attachment of the process (-1 with EISCONN if it is attached) and holds it until
+// m_engine_release, which attaches the process if attached is set and undoes m_attach_engine otherwise
+int m_engine_claim();
+int m_attach_engine(mtp_socket *sm, mtp_control *ctrl, void (*handler)(mtp_request *r), int (*kick)(int i));
+void m_engine_release(int attached);
+
+// Functions for the locks of the MTP socket entries and of the table: robust process-shared mutexes whose
+// uncontended lock and unlock take no system call
+// m_mutex_lock recovers the lock of a thread that died holding it, then returns 1 (0 otherwise)
+int m_mutex_init(pthread_mutex_t *mutex);
+int m_mutex_lock(pthread_mutex_t *mutex);
+void m_mutex_unlock(pthread_mutex_t *mutex);
+
+// Functions to lock and unlock an MTP socket entry, keeping stats_seq odd while the lock is held
+// m_entry_lock returns 1 if it recovered the lock of a thread that died holding it (see m_mutex_lock), 0 otherwise
+int m_entry_lock(mtp_socket *entry);
+void m_entry_unlock(mtp_socket *entry);
+
 // Function to create a new MTP socket
 // type must be SOCK_MTP
 // Returns the socket id on success, -1 on failure
 int m_socket(int domain, int type, int protocol);
 
+// Function to create n MTP sockets at once, in sockfds; the requests to initmsocket are handed over together
+// Returns the number of sockets created (fewer than n if the table fills up), -1 on failure
+int m_socket_batch(int domain, int type, int protocol, int *sockfds, int n);
+
 // Function to bind the MTP socket to a specific address
 // Returns 0 on success, -1 on failure
 int m_bind(int sockfd, char *source_ip, int source_port, char *dest_ip, int dest_port);
 
 // Function to send a message to the MTP socket
+// Blocks while the send buffer is full, with MSG_DONTWAIT it fails with ENOBUFS instead
 // Returns the number of bytes sent on success, -1 on failure
 int m_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 
 // Function to receive a message from the MTP socket
+// Blocks while the receive buffer is empty, with MSG_DONTWAIT it fails with ENOMSG instead
 // Returns the number of bytes received on success, -1 on failure
 int m_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 
+// Same as m_sendto and m_recvfrom, but block for at most timeout_ms milliseconds (forever if negative)
+// Fail with ETIMEDOUT when the timeout expires
+int m_sendto_timeout(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, int timeout_ms);
+int m_recvfrom_timeout(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen, int timeout_ms);
+
+// Zero-copy sending: m_send_reserve returns the next send buffer entry of the MTP socket, MESSAGE_SIZE bytes in
+// shared memory that the application writes the message into, and m_send_commit hands the first len bytes to the
+// peer the socket is bound to (len 0 gives the entry back). One entry can be reserved at a time, m_sendto and
+// m_send_reserve fail with EBUSY until it is committed
+// m_send_reserve blocks while the send buffer is full, with MSG_DONTWAIT it fails with ENOBUFS instead
+// Return the entry (NULL on failure) and len (-1 on failure, EINVAL without a reservation)
+void *m_send_reserve(int sockfd, int flags);
+int m_send_commit(int sockfd, size_t len);
+
+// Zero-copy receiving: m_recv_peek returns the next message in its receive buffer entry, read-only and valid until
+// m_recv_release frees the entry. m_recvfrom and m_recv_peek fail with EBUSY while a message is peeked
+// m_recv_peek blocks while the receive buffer is empty, with MSG_DONTWAIT it fails with ENOMSG instead
+// Return the message with its length in len (NULL on failure) and 0 (-1 on failure, EINVAL without a peeked message)
+const void *m_recv_peek(int sockfd, size_t *len, int flags);
+int m_recv_release(int sockfd);
+
+// Same as m_send_reserve and m_recv_peek, but block for at most timeout_ms milliseconds (forever if negative)
+void *m_send_reserve_timeout(int sockfd, int flags, int timeout_ms);
+const void *m_recv_peek_timeout(int sockfd, size_t *len, int flags, int timeout_ms);
+
+// Byte-stream interface over the messages of the MTP socket, to and from the peer it is bound to
+// m_write segments buf into messages of at most MESSAGE_SIZE bytes, topping up the last message it wrote while it
+// is not sent yet, with one lock of the entry per call. It blocks until all len bytes are written; with MSG_DONTWAIT
+// it writes what fits and fails with ENOBUFS if nothing does
+// m_read blocks until at least one byte is there (with MSG_DONTWAIT it fails with ENOMSG instead), then returns
+// up to len bytes of the next messages in order; a message read in part is continued by the next call
+// Return the number of bytes written or read, -1 on failure
+int m_write(int sockfd, const void *buf, size_t len, int flags);
+int m_read(int sockfd, void *buf, size_t len, int flags);
+
+// Same as m_write and m_read, but block for at most timeout_ms milliseconds (forever if negative)
+// m_write returns the bytes written before the timeout if there are any
+int m_write_timeout(int sockfd, const void *buf, size_t len, int flags, int timeout_ms);
+int m_read_timeout(int sockfd, void *buf, size_t len, int flags, int timeout_ms);
+
+// Batch interface: move up to n messages with one lock of the entry and one doorbell per call
+// m_sendto_batch checks the messages and the address once, then queues them in order; it blocks until all n are
+// queued, with MSG_DONTWAIT it queues what fits and fails with ENOBUFS if nothing does
+// m_recvfrom_batch blocks until a message is there (with MSG_DONTWAIT it fails with ENOMSG instead), then takes
+// the next messages in order that are there, up to n, setting msg_len of each
+// Return the number of messages sent or received, -1 on failure
+int m_sendto_batch(int sockfd, const mtp_msg *msgs, int n, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
+int m_recvfrom_batch(int sockfd, mtp_msg *msgs, int n, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+
+// Same as m_sendto_batch and m_recvfrom_batch, but block for at most timeout_ms milliseconds (forever if negative)
+// m_sendto_batch returns the messages queued before the timeout if there are any
+int m_sendto_batch_timeout(int sockfd, const mtp_msg *msgs, int n, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, int timeout_ms);
+int m_recvfrom_batch_timeout(int sockfd, mtp_msg *msgs, int n, int flags, struct sockaddr *src_addr, socklen_t *addrlen, int timeout_ms);
+
 // Function to close the MTP socket
 // Returns 0 on success, -1 on failure
 int m_close(int sockfd);
 
+// Function to select the congestion control algorithm of the MTP socket ("reno", the default, "cubic" or "vegas")
+// Resets the congestion window, so it is meant to be called before sending
+// Returns 0 on success, -1 on failure (EINVAL for an unknown algorithm)
+int m_setcc(int sockfd, const char *name);
+
+// Function to take a consistent snapshot of the counters and the state of the MTP socket without its lock, so that
+// it can be sampled at any rate without slowing it down (any process attached to initmsocket can read any socket)
+// Returns 0 on success, -1 on failure (EBADF if the socket is not in use, EAGAIN if it stayed locked throughout)
+int m_getstats(int sockfd, mtp_stats *stats);
+
+// Function to take a snapshot of every MTP socket in use, of every process, storing at most n of them in stats
+// Returns the number of sockets in use (more than n if some did not fit), -1 on failure
+int m_getstats_all(mtp_stats *stats, int n);
+
 // Function to print the information of the MTP socket
 void prinfo();
 
+// Function to wait on the futex at addr while it holds val, until the absolute CLOCK_MONOTONIC deadline (NULL waits forever)
+// Returns 0 when woken up or if *addr != val, -1 on timeout (ETIMEDOUT) or signal (EINTR)
+int m_futex_wait(volatile int *addr, int val, const struct timespec *deadline);
+
+// Function to wake up every process waiting on the futex at addr
+void m_futex_wake(volatile int *addr);
+
+// Function to get the start time of process pid since boot in clock ticks (field starttime of /proc/pid/stat), 0 if
+// it cannot be read; m_self_start returns the one of the calling process, read once per process
+unsigned long long m_process_start(int pid);
+unsigned long long m_self_start();
+
+// Function to check whether process pid, started at start (0 if unknown), is still running
+// kill(pid, 0) only tells that some process has the pid: EPERM is a live process of another user, and a pid can be
+// reused by a new process, which the start time tells apart. Returns 1 if it is alive, 0 if it is gone
+int m_process_alive(int pid, unsigned long long start);
+
+// Function to ring the doorbell of the worker owning MTP socket i, so that its new data is sent right away
+// The worker is only sent a wakeup datagram (on the socket of m_worker_addr) if it sleeps
+void m_doorbell(mtp_control *ctrl, int i);
+
+// Function to ring the doorbell of sockfd, or with an embedded engine to do the work of its worker right away
+// when it is idle (see engine_kick); called without the entry lock
+void m_ring(int sockfd);
+
+// Function to mark MTP socket i ready for its worker without waking it up, used by the workers themselves
+void m_mark_ready(mtp_control *ctrl, int i);
+
+// Function for worker w to take the sockets of its shard whose doorbell was rung since the last call
+// Stores their indices in ready (room for its shard) and returns their number
+int m_table_ready(mtp_control *ctrl, int w, int *ready);
+
+// Function to check whether worker w has sockets marked ready, without taking them
+int m_table_ready_pending(mtp_control *ctrl, int w);
+
+// Function to get the address of the wakeup socket of worker w, an abstract unix datagram socket
+void m_worker_addr(int w, struct sockaddr_un *addr, socklen_t *len);
+
+// Size of the control segment for a table of max_sockets MTP sockets served by workers threads
+size_t m_control_size(int max_sockets, int workers);
+
+// Functions of the request ring of initmsocket (see mtp_request)
+// A requester claims a slot (waiting while the ring is full), fills in the request and submits it, waits for the
+// answer in the slot and releases the slot; initmsocket takes the next published request with m_request_next
+// (NULL if there is none) and hands the answer back with m_request_answer
+mtp_request *m_request_claim(mtp_control *ctrl);
+void m_request_submit(mtp_control *ctrl, mtp_request *r);
+void m_request_wait(mtp_request *r);
+void m_request_release(mtp_request *r);
+mtp_request *m_request_next(mtp_control *ctrl);
+void m_request_answer(mtp_control *ctrl, mtp_request *r);
+
+// Function to mark every entry of the MTP socket table free, called by initmsocket at startup
+void m_table_init(mtp_control *ctrl, int max_sockets, int workers);
+
+// Functions to allocate the lowest free entry of the MTP socket table (-1 if it is full) and to release an entry
+// Both take constant time (find first set on a two level bitmap) and keep the list of entries in use up to date;
+// the caller holds table_lock
+int m_table_alloc(mtp_control *ctrl);
+void m_table_release(mtp_control *ctrl, int i);
+
+// Function to get the list of entries in use, of length ctrl->active_count
+// The workers and G walk it without table_lock: a release may move the last entry into the released position,
+// so a walk can miss an entry once, and they check is_free under the entry lock
+int *m_table_active(mtp_control *ctrl);
+
 // Function to drop a message with probability p
 int dropMessage(float p);
 
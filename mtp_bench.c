@@ -0,0 +1,870 @@
+/**
+ * @file mtp_bench.c
+ *
+ * @brief Benchmarks for the MTP socket library.
+ * initmsocket must be running in the same directory.
+ *
+ * Modes:
+ *   scale  - aggregate throughput as the number of concurrent sender/receiver socket pairs grows.
+ *            Every pair runs in its own pair of processes so that they only share the MTP daemon.
+ *   sendto - m_sendto calls per second on a single socket. Once the send buffer is full the calls
+ *            fail with ENOBUFS, they are counted too as they pay the same per-call library overhead.
+ *   fair   - n concurrent flows, flow i using the i-th congestion control algorithm of -c (the last one
+ *            repeats), with the per-flow throughput and Jain's fairness index. Run initmsocket with a
+ *            bottleneck (-r) so that the flows compete for it.
+ *   open   - opens and binds n idle sockets in one process (initmsocket -n must allow them), with the latency of
+ *            m_socket, m_bind and m_close, the CPU time the daemon spends on the idle sockets and the throughput
+ *            of one pair before and after they are opened.
+ *   lock   - lock/unlock pairs per second of 1, 2, 4, ... n processes on one lock, with a SysV semaphore (the
+ *            entry locks before) and with the robust process-shared mutex of the entries (m_mutex_lock), and a
+ *            check that the mutex of a process that dies holding it is recovered. Does not need initmsocket.
+ *   latency - round trips of one message_size message between two processes, the second one echoing it back, with
+ *            the mean, median, 99th percentile and maximum in us. Run it with initmsocket and with -e to compare the
+ *            daemon with the engine embedded in each process.
+ *   startup - time to open and bind n sockets (initmsocket -n must allow them) split over 1, 2, 4, ... processes
+ *            with m_socket, and in one process with m_socket_batch, so with concurrent requests to the daemon.
+ *   oneway - goodput of n pairs with the one-way latency of every message: the sender
+ *            writes the time the message enters its send buffer into its first bytes and the receiver subtracts it
+ *            from the time m_recvfrom returns it, so it includes the queueing in both buffers and the retransmissions.
+ *            Prints one CSV row (or a JSON object with -j) with the window, the loss rate given with -P (the one of
+ *            initmsocket -p, only recorded), messages/s, goodput and the mean, median, 99th, 99.9th percentile and
+ *            maximum latency in us; with -r rate every sender sends at most rate messages/s instead of saturating.
+ *
+ * With -z the pairs of scale and fair use the zero-copy calls (m_send_reserve/m_send_commit and
+ * m_recv_peek/m_recv_release) instead of m_sendto and m_recvfrom.
+ * With -w the pairs of scale and fair use the byte-stream calls instead, m_write and m_read of message_size bytes,
+ * and count message_size bytes as one message.
+ * With -b batch they use m_sendto_batch and m_recvfrom_batch of up to batch messages per call.
+ * With -e every process of scale, fair, sendto, latency and oneway runs its own engine (m_embed) instead of using
+ * initmsocket.
+ * With -H oneway leaves out the CSV header, to append its row to the results of an earlier run.
+ *
+ * Usage: ./mtp_bench <mode> [-n max_pairs] [-d seconds] [-s message_size] [-p base_port] [-c algo,algo,...] [-z | -w | -b batch] [-e]
+ *                          [-r rate] [-P loss] [-j] [-H]
+ */
+#include <msocket.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+
+int max_pairs = 8;
+int duration = 12;
+int msg_size = MESSAGE_SIZE;
+int base_port = 20000;
+#define MAX_CC_NAMES 16
+char *cc_names[MAX_CC_NAMES];
+int cc_count = 0;
+int zero_copy = 0;
+int stream = 0;
+int batch = 0;
+int embedded = 0;
+int rate = 0;
+double loss = 0;
+int json = 0;
+int no_header = 0;
+#define MAX_BATCH 1024
+#define MAX_ROUND_TRIPS (1 << 20)
+
+// one-way latencies in us of the messages received by the receivers of oneway, shared by their processes
+#define MAX_SAMPLES (1 << 22)
+typedef struct latency_samples
+{
+    long count;
+    double start; // the messages sent before, during the second run_pairs leaves to bind the sockets, are not counted
+    double us[];
+} latency_samples;
+latency_samples *latency = NULL;
+
+void parse_args(int argc, char *argv[]);
+
+// ---------------- Helper Functions ---------------- //
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// milliseconds left until the deadline
+int remaining_ms(double deadline)
+{
+    double left = deadline - now();
+    return left > 0 ? (int)(left * 1000) : 0;
+}
+
+// open and bind an MTP socket from port to peer_port on loopback
+int open_pair_socket(int port, int peer_port)
+{
+    // with -e the first socket of the process starts its engine
+    if (embedded && m_embed(4, 1) < 0 && errno != EISCONN)
+    {
+        pperror("m_embed");
+        exit(1);
+    }
+    int sfd = m_socket(AF_INET, SOCK_MTP, 0);
+    if (sfd < 0)
+    {
+        pperror("m_socket");
+        exit(1);
+    }
+    if (m_bind(sfd, "127.0.0.1", port, "127.0.0.1", peer_port) < 0)
+    {
+        pperror("m_bind");
+        m_close(sfd);
+        exit(1);
+    }
+    return sfd;
+}
+
+// congestion control algorithm of flow i, NULL for the default
+char *flow_cc(int i)
+{
+    if (cc_count == 0)
+        return NULL;
+    return cc_names[i < cc_count ? i : cc_count - 1];
+}
+
+// send messages until the deadline
+void run_sender(int port, int peer_port, double deadline, char *cc)
+{
+    int sfd = open_pair_socket(port, peer_port);
+    if (cc != NULL && m_setcc(sfd, cc) < 0)
+    {
+        pperror("m_setcc");
+        m_close(sfd);
+        exit(1);
+    }
+    struct sockaddr_in peer;
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(peer_port);
+    peer.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    char buff[MESSAGE_SIZE];
+    memset(buff, 'x', sizeof(buff));
+    // the messages of a batch all point at the same buffer
+    static mtp_msg msgs[MAX_BATCH];
+    for (int k = 0; k < batch; k++)
+    {
+        msgs[k].buf = buff;
+        msgs[k].len = msg_size;
+    }
+    double next = now();
+    while (now() < deadline)
+    {
+        if (latency != NULL)
+        {
+            if (rate > 0)
+            {
+                next += 1.0 / rate;
+                if (next > now())
+                    usleep((next - now()) * 1e6);
+            }
+            // the time is taken once the slot is reserved, so that waiting for space in the buffer does not count
+            char *slot = m_send_reserve_timeout(sfd, 0, remaining_ms(deadline));
+            if (slot != NULL)
+            {
+                double t = now();
+                memset(slot, 'x', msg_size);
+                memcpy(slot, &t, sizeof(t));
+                m_send_commit(sfd, msg_size);
+            }
+            continue;
+        }
+        // block until there is space in the send buffer, but not past the deadline
+        if (batch)
+        {
+            m_sendto_batch_timeout(sfd, msgs, batch, 0, (struct sockaddr *)&peer, sizeof(peer), remaining_ms(deadline));
+            continue;
+        }
+        if (stream)
+        {
+            m_write_timeout(sfd, buff, msg_size, 0, remaining_ms(deadline));
+            continue;
+        }
+        if (!zero_copy)
+        {
+            m_sendto_timeout(sfd, buff, msg_size, 0, (struct sockaddr *)&peer, sizeof(peer), remaining_ms(deadline));
+            continue;
+        }
+        char *slot = m_send_reserve_timeout(sfd, 0, remaining_ms(deadline));
+        if (slot != NULL)
+        {
+            memset(slot, 'x', msg_size);
+            m_send_commit(sfd, msg_size);
+        }
+    }
+    m_close(sfd);
+    exit(0);
+}
+
+// receive messages until the deadline and report the flow index and count on fd
+void run_receiver(int port, int peer_port, double deadline, int fd, int index)
+{
+    int sfd = open_pair_socket(port, peer_port);
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+
+    char buff[MESSAGE_SIZE];
+    long count = 0, bytes = 0;
+    static mtp_msg msgs[MAX_BATCH];
+    for (int k = 0; k < batch; k++)
+    {
+        msgs[k].buf = buff;
+        msgs[k].len = sizeof(buff);
+    }
+    while (now() < deadline)
+    {
+        if (latency != NULL)
+        {
+            if (m_recvfrom_timeout(sfd, buff, MESSAGE_SIZE, 0, (struct sockaddr *)&peer, &len, remaining_ms(deadline)) >= (int)sizeof(double))
+            {
+                double sent;
+                memcpy(&sent, buff, sizeof(sent));
+                if (sent < latency->start)
+                    continue;
+                long k = __atomic_fetch_add(&latency->count, 1, __ATOMIC_RELAXED);
+                if (k < MAX_SAMPLES)
+                    latency->us[k] = (now() - sent) * 1e6;
+                count++;
+            }
+            continue;
+        }
+        if (batch)
+        {
+            int n = m_recvfrom_batch_timeout(sfd, msgs, batch, 0, (struct sockaddr *)&peer, &len, remaining_ms(deadline));
+            if (n > 0)
+                count += n;
+            continue;
+        }
+        if (stream)
+        {
+            int n = m_read_timeout(sfd, buff, msg_size, 0, remaining_ms(deadline));
+            if (n > 0)
+                bytes += n;
+            continue;
+        }
+        if (!zero_copy)
+        {
+            if (m_recvfrom_timeout(sfd, buff, MESSAGE_SIZE, 0, (struct sockaddr *)&peer, &len, remaining_ms(deadline)) >= 0)
+                count++;
+            continue;
+        }
+        size_t n;
+        const char *message = m_recv_peek_timeout(sfd, &n, 0, remaining_ms(deadline));
+        if (message != NULL)
+        {
+            // look at the message where it is, as a parser would
+            buff[0] = message[n - 1];
+            m_recv_release(sfd);
+            count++;
+        }
+    }
+    if (stream)
+        count = bytes / msg_size;
+    long report[2] = {index, count};
+    write(fd, report, sizeof(report));
+    m_close(sfd);
+    exit(0);
+}
+
+// run n pairs for the configured duration and return the number of messages delivered
+// the count of every pair is stored in counts if it is not NULL
+long run_pairs(int n, int port, long *counts)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        pperror("pipe");
+        exit(1);
+    }
+    // leave time for every process to create and bind its socket
+    double deadline = now() + duration + 1;
+    for (int i = 0; i < n; i++)
+    {
+        int send_port = port + 2 * i;
+        int recv_port = port + 2 * i + 1;
+        if (fork() == 0)
+        {
+            close(fds[0]);
+            run_receiver(recv_port, send_port, deadline, fds[1], i);
+        }
+        if (fork() == 0)
+        {
+            close(fds[0]);
+            run_sender(send_port, recv_port, deadline, flow_cc(i));
+        }
+    }
+    close(fds[1]);
+
+    long total = 0, report[2];
+    while (read(fds[0], report, sizeof(report)) == sizeof(report))
+    {
+        total += report[1];
+        if (counts != NULL)
+            counts[report[0]] = report[1];
+    }
+    close(fds[0]);
+    while (wait(NULL) > 0)
+        ;
+    return total;
+}
+
+void bench_scale()
+{
+    printf("pairs,messages,msgs_per_sec,kbytes_per_sec\n");
+    fflush(stdout);
+    int round = 0;
+    int n = 1;
+    while (1)
+    {
+        // fresh ports every round, so that late datagrams of the previous round find no socket
+        long total = run_pairs(n, base_port + 100 * round++, NULL);
+        double rate = (double)total / duration;
+        printf("%d,%ld,%.1f,%.1f\n", n, total, rate, rate * msg_size / 1024);
+        fflush(stdout);
+        if (n == max_pairs)
+            break;
+        n = n * 2 > max_pairs ? max_pairs : n * 2;
+    }
+}
+
+void bench_fair()
+{
+    long *counts = calloc(max_pairs, sizeof(long));
+    long total = run_pairs(max_pairs, base_port, counts);
+
+    // Jain's index: (sum x)^2 / (n * sum x^2), 1 when every flow gets the same share, 1/n when one takes all
+    double sum = 0, sum_sq = 0;
+    printf("flow,cc,messages,msgs_per_sec,kbytes_per_sec\n");
+    for (int i = 0; i < max_pairs; i++)
+    {
+        double rate = (double)counts[i] / duration;
+        sum += rate;
+        sum_sq += rate * rate;
+        printf("%d,%s,%ld,%.1f,%.1f\n", i, flow_cc(i) ? flow_cc(i) : "reno", counts[i], rate, rate * msg_size / 1024);
+    }
+    double jain = sum_sq > 0 ? sum * sum / (max_pairs * sum_sq) : 0;
+    printf("total,%ld,%.1f,jain,%.3f\n", total, (double)total / duration, jain);
+    free(counts);
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// q quantile of n sorted values, 0 if there are none
+double percentile(const double *sorted, long n, double q)
+{
+    if (n == 0)
+        return 0;
+    long k = (long)(n * q);
+    return sorted[k < n ? k : n - 1];
+}
+
+// print mean, median, 99th percentile and maximum of n latencies in us
+void print_latency(const char *op, double *us, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += us[i];
+    qsort(us, n, sizeof(double), compare_double);
+    printf("%s,%d,%.1f,%.1f,%.1f,%.1f\n", op, n, sum / n, percentile(us, n, 0.5), percentile(us, n, 0.99), us[n - 1]);
+}
+
+// CPU time (user + system) of initmsocket in seconds, the creator of the MTP socket table segment
+double daemon_cpu()
+{
+    struct shmid_ds ds;
+    if (shmctl(shmget(ftok("initmsocket.c", MTP_SOCKET_KEY), 0, 0), IPC_STAT, &ds) == -1)
+        return 0;
+    char path[64];
+    sprintf(path, "/proc/%d/stat", ds.shm_cpid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    // utime and stime are the 14th and 15th fields, the 2nd (comm) is in parentheses
+    unsigned long utime = 0, stime = 0;
+    fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(f);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void bench_open()
+{
+    int n = max_pairs;
+    int *fds = malloc(n * sizeof(int));
+    double *create_us = malloc(n * sizeof(double)), *bind_us = malloc(n * sizeof(double)), *close_us = malloc(n * sizeof(double));
+
+    long before = run_pairs(1, base_port, NULL);
+
+    // idle sockets on the ports after the pair, towards a port nobody listens on
+    for (int k = 0; k < n; k++)
+    {
+        double t0 = now();
+        fds[k] = m_socket(AF_INET, SOCK_MTP, 0);
+        double t1 = now();
+        if (fds[k] < 0)
+        {
+            printf("m_socket failed after %d sockets: %s\n", k, strerror(errno));
+            exit(1);
+        }
+        if (m_bind(fds[k], "127.0.0.1", base_port + 100 + k, "127.0.0.1", base_port + 99) < 0)
+        {
+            printf("m_bind failed after %d sockets: %s\n", k, strerror(errno));
+            exit(1);
+        }
+        double t2 = now();
+        create_us[k] = (t1 - t0) * 1e6;
+        bind_us[k] = (t2 - t1) * 1e6;
+    }
+
+    // daemon time spent on idle sockets: window updates and garbage collection
+    double cpu = daemon_cpu(), start = now();
+    sleep(duration);
+    double idle = (daemon_cpu() - cpu) / (now() - start);
+
+    long after = run_pairs(1, base_port + 2, NULL);
+
+    for (int k = 0; k < n; k++)
+    {
+        double t0 = now();
+        m_close(fds[k]);
+        close_us[k] = (now() - t0) * 1e6;
+    }
+
+    printf("op,count,mean_us,p50_us,p99_us,max_us\n");
+    print_latency("m_socket", create_us, n);
+    print_latency("m_bind", bind_us, n);
+    print_latency("m_close", close_us, n);
+    printf("sockets,shm_bytes_per_socket,daemon_idle_cpu_pct,daemon_idle_us_per_socket_per_sec,pair_msgs_per_sec_before,pair_msgs_per_sec_after\n");
+    printf("%d,%zu,%.2f,%.3f,%.1f,%.1f\n", n, sizeof(mtp_socket), idle * 100, idle * 1e6 / n, (double)before / duration, (double)after / duration);
+    free(fds);
+    free(create_us);
+    free(bind_us);
+    free(close_us);
+}
+
+void bench_sendto()
+{
+    int sfd = open_pair_socket(base_port, base_port + 1);
+    struct sockaddr_in peer;
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(base_port + 1);
+    peer.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    char buff[MESSAGE_SIZE];
+    memset(buff, 'x', sizeof(buff));
+    long calls = 0, sent = 0;
+    double start = now(), end = start + duration;
+    while (now() < end)
+    {
+        // check the clock every 1024 calls only
+        for (int i = 0; i < 1024; i++)
+        {
+            if (m_sendto(sfd, buff, msg_size, MSG_DONTWAIT, (struct sockaddr *)&peer, sizeof(peer)) >= 0)
+                sent++;
+        }
+        calls += 1024;
+    }
+    double elapsed = now() - start;
+    printf("calls,accepted,seconds,calls_per_sec\n");
+    printf("%ld,%ld,%.2f,%.0f\n", calls, sent, elapsed, calls / elapsed);
+    m_close(sfd);
+}
+
+// lock and unlock sem (a SysV semaphore) or mutex until the deadline, return the number of pairs
+long lock_loop(int sem, pthread_mutex_t *mutex, volatile long *shared, double deadline)
+{
+    struct sembuf pop = {0, -1, 0}, vop = {0, 1, 0};
+    long ops = 0;
+    while (1)
+    {
+        // look at the clock every 1024 pairs only
+        for (int k = 0; k < 1024; k++)
+        {
+            if (mutex == NULL)
+                semop(sem, &pop, 1);
+            else
+                m_mutex_lock(mutex);
+            (*shared)++;
+            if (mutex == NULL)
+                semop(sem, &vop, 1);
+            else
+                m_mutex_unlock(mutex);
+        }
+        ops += 1024;
+        if (now() >= deadline)
+            return ops;
+    }
+}
+
+void bench_lock()
+{
+    // the mutex and a counter it guards live in shared memory, as in the MTP socket table
+    struct
+    {
+        pthread_mutex_t mutex;
+        long counter;
+    } *shm = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int sem = semget(IPC_PRIVATE, 1, 0600);
+    if (shm == MAP_FAILED || sem == -1 || m_mutex_init(&shm->mutex) < 0)
+    {
+        pperror("bench_lock");
+        exit(1);
+    }
+    semctl(sem, 0, SETVAL, 1);
+
+    printf("lock,processes,pairs,pairs_per_sec,ns_per_pair\n");
+    fflush(stdout);
+    for (int mutex = 0; mutex <= 1; mutex++)
+    {
+        int n = 1;
+        while (1)
+        {
+            int fds[2];
+            if (pipe(fds) < 0)
+            {
+                pperror("pipe");
+                exit(1);
+            }
+            double start = now(), deadline = start + duration;
+            for (int i = 0; i < n; i++)
+            {
+                if (fork() == 0)
+                {
+                    long ops = lock_loop(sem, mutex ? &shm->mutex : NULL, &shm->counter, deadline);
+                    write(fds[1], &ops, sizeof(ops));
+                    exit(0);
+                }
+            }
+            close(fds[1]);
+            long total = 0, ops;
+            while (read(fds[0], &ops, sizeof(ops)) == sizeof(ops))
+                total += ops;
+            close(fds[0]);
+            while (wait(NULL) > 0)
+                ;
+            double elapsed = now() - start;
+            printf("%s,%d,%ld,%.0f,%.1f\n", mutex ? "mutex" : "semaphore", n, total, total / elapsed, elapsed * 1e9 * n / total);
+            fflush(stdout);
+            if (n == max_pairs)
+                break;
+            n = n * 2 > max_pairs ? max_pairs : n * 2;
+        }
+    }
+
+    // a process that dies holding the mutex: the next locker gets it back
+    if (fork() == 0)
+    {
+        m_mutex_lock(&shm->mutex);
+        _exit(0);
+    }
+    wait(NULL);
+    int recovered = m_mutex_lock(&shm->mutex);
+    m_mutex_unlock(&shm->mutex);
+    printf("owner_died,recovered,%s\n", recovered ? "yes" : "no");
+
+    semctl(sem, 0, IPC_RMID);
+    munmap(shm, 4096);
+}
+
+// round trips of one message, the echo process sends every message back to where it came from
+void bench_latency()
+{
+    double deadline = now() + duration;
+    pid_t echo = fork();
+    if (echo == 0)
+    {
+        int sfd = open_pair_socket(base_port + 1, base_port);
+        char buff[MESSAGE_SIZE];
+        struct sockaddr_in peer;
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(base_port);
+        peer.sin_addr.s_addr = inet_addr("127.0.0.1");
+        // the echo waits a second longer than the client, so that the last round trip completes
+        int n;
+        while ((n = m_recvfrom_timeout(sfd, buff, sizeof(buff), 0, NULL, NULL, remaining_ms(deadline + 1))) > 0)
+            m_sendto(sfd, buff, n, 0, (struct sockaddr *)&peer, sizeof(peer));
+        m_close(sfd);
+        exit(0);
+    }
+
+    int sfd = open_pair_socket(base_port, base_port + 1);
+    struct sockaddr_in peer;
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(base_port + 1);
+    peer.sin_addr.s_addr = inet_addr("127.0.0.1");
+    char buff[MESSAGE_SIZE];
+    memset(buff, 'x', sizeof(buff));
+    double *us = malloc(MAX_ROUND_TRIPS * sizeof(double));
+
+    // the first round trip waits for the echo to be bound, it is not counted
+    int count = -1;
+    while (now() < deadline && count < MAX_ROUND_TRIPS)
+    {
+        double t0 = now();
+        m_sendto(sfd, buff, msg_size, 0, (struct sockaddr *)&peer, sizeof(peer));
+        if (m_recvfrom_timeout(sfd, buff, sizeof(buff), 0, NULL, NULL, remaining_ms(deadline)) <= 0)
+            break;
+        if (count >= 0)
+            us[count] = (now() - t0) * 1e6;
+        count++;
+    }
+    m_close(sfd);
+    waitpid(echo, NULL, 0);
+
+    printf("op,count,mean_us,p50_us,p99_us,max_us\n");
+    if (count > 0)
+        print_latency(embedded ? "round_trip_embedded" : "round_trip_daemon", us, count);
+    free(us);
+}
+
+// opens and binds count sockets from port, with m_socket_batch if batched, and returns the seconds it took
+double open_sockets(int count, int port, int batched, int *fds)
+{
+    double start = now();
+    for (int k = 0; k < count;)
+    {
+        int got = batched ? m_socket_batch(AF_INET, SOCK_MTP, 0, fds + k, count - k) : m_socket(AF_INET, SOCK_MTP, 0);
+        if (got < 0)
+        {
+            printf("m_socket failed after %d sockets: %s\n", k, strerror(errno));
+            exit(1);
+        }
+        if (!batched)
+        {
+            fds[k] = got;
+            got = 1;
+        }
+        for (int j = k; j < k + got; j++)
+        {
+            if (m_bind(fds[j], "127.0.0.1", port + j, "127.0.0.1", port - 1) < 0)
+            {
+                printf("m_bind failed after %d sockets: %s\n", j, strerror(errno));
+                exit(1);
+            }
+        }
+        k += got;
+    }
+    return now() - start;
+}
+
+void bench_startup()
+{
+    int n = max_pairs;
+    int *fds = malloc(n * sizeof(int));
+
+    // m_socket in 1, 2 and 4 processes, then m_socket_batch in one
+    int runs[][2] = {{1, 0}, {2, 0}, {4, 0}, {1, 1}};
+    printf("api,processes,sockets,seconds,sockets_per_sec\n");
+    fflush(stdout);
+    for (int r = 0; r < 4; r++)
+    {
+        int procs = runs[r][0], batched = runs[r][1];
+        if (procs > n)
+            continue;
+        int fds_pipe[2];
+        if (pipe(fds_pipe) < 0)
+        {
+            pperror("pipe");
+            exit(1);
+        }
+        // every process opens its share of the sockets and reports how long it took, the slowest one counts
+        for (int i = 0; i < procs; i++)
+        {
+            if (fork() == 0)
+            {
+                int count = n / procs + (i < n % procs);
+                int first = i * (n / procs) + (i < n % procs ? i : n % procs);
+                double seconds = open_sockets(count, base_port + 1 + first, batched, fds);
+                write(fds_pipe[1], &seconds, sizeof(seconds));
+                for (int k = 0; k < count; k++)
+                    m_close(fds[k]);
+                exit(0);
+            }
+        }
+        close(fds_pipe[1]);
+        double seconds, slowest = 0;
+        while (read(fds_pipe[0], &seconds, sizeof(seconds)) == sizeof(seconds))
+            slowest = seconds > slowest ? seconds : slowest;
+        close(fds_pipe[0]);
+        while (wait(NULL) > 0)
+            ;
+        printf("%s,%d,%d,%.4f,%.0f\n", batched ? "m_socket_batch" : "m_socket", procs, n, slowest, n / slowest);
+        fflush(stdout);
+    }
+    free(fds);
+}
+
+// goodput and one-way latency of max_pairs pairs, one result row
+void bench_oneway()
+{
+    if (msg_size < (int)sizeof(double))
+    {
+        printf("oneway needs messages of at least %zu bytes for the send time\n", sizeof(double));
+        exit(1);
+    }
+    if (zero_copy || stream || batch)
+    {
+        printf("oneway uses m_send_reserve and m_recvfrom, it takes none of -z, -w and -b\n");
+        exit(1);
+    }
+    // the pages of the samples are only allocated as the receivers fill them
+    size_t size = sizeof(latency_samples) + MAX_SAMPLES * sizeof(double);
+    latency = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (latency == MAP_FAILED)
+    {
+        pperror("mmap");
+        exit(1);
+    }
+    latency->start = now() + 1;
+    long total = run_pairs(max_pairs, base_port, NULL);
+
+    long n = latency->count < MAX_SAMPLES ? latency->count : MAX_SAMPLES;
+    double sum = 0;
+    for (long k = 0; k < n; k++)
+        sum += latency->us[k];
+    qsort(latency->us, n, sizeof(double), compare_double);
+    double msgs = (double)total / duration;
+    double mean = n > 0 ? sum / n : 0, p50 = percentile(latency->us, n, 0.5), p99 = percentile(latency->us, n, 0.99);
+    double p999 = percentile(latency->us, n, 0.999), max = percentile(latency->us, n, 1);
+
+    if (json)
+        printf("{\"window\":%d,\"loss\":%g,\"message_size\":%d,\"pairs\":%d,\"rate\":%d,\"seconds\":%d,\"messages\":%ld,"
+               "\"msgs_per_sec\":%.1f,\"kbytes_per_sec\":%.1f,\"samples\":%ld,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+               "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               MAX_WINDOW_SIZE, loss, msg_size, max_pairs, rate, duration, total, msgs, msgs * msg_size / 1024, n, mean, p50, p99, p999, max);
+    else
+    {
+        if (!no_header)
+            printf("window,loss,message_size,pairs,rate,seconds,messages,msgs_per_sec,kbytes_per_sec,samples,mean_us,p50_us,p99_us,p999_us,max_us\n");
+        printf("%d,%g,%d,%d,%d,%d,%ld,%.1f,%.1f,%ld,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               MAX_WINDOW_SIZE, loss, msg_size, max_pairs, rate, duration, total, msgs, msgs * msg_size / 1024, n, mean, p50, p99, p999, max);
+    }
+    munmap(latency, size);
+    latency = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <scale|sendto|fair|open|lock|startup|latency|oneway> [-n max_pairs] [-d seconds] [-s message_size] [-p base_port] [-c algo,...] [-z | -w | -b batch] [-e] [-r rate] [-P loss] [-j] [-H]\n", argv[0]);
+        exit(1);
+    }
+    char *mode = argv[1];
+    parse_args(argc - 1, argv + 1);
+
+    if (strcmp(mode, "scale") == 0)
+        bench_scale();
+    else if (strcmp(mode, "sendto") == 0)
+        bench_sendto();
+    else if (strcmp(mode, "fair") == 0)
+        bench_fair();
+    else if (strcmp(mode, "open") == 0)
+        bench_open();
+    else if (strcmp(mode, "lock") == 0)
+        bench_lock();
+    else if (strcmp(mode, "startup") == 0)
+        bench_startup();
+    else if (strcmp(mode, "latency") == 0)
+        bench_latency();
+    else if (strcmp(mode, "oneway") == 0)
+        bench_oneway();
+    else
+    {
+        printf("Unknown mode: %s\n", mode);
+        exit(1);
+    }
+    return 0;
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:s:p:c:zwb:er:P:jH")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'P':
+            loss = atof(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'H':
+            no_header = 1;
+            break;
+        case 'z':
+            zero_copy = 1;
+            break;
+        case 'e':
+            embedded = 1;
+            break;
+        case 'w':
+            stream = 1;
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'n':
+            max_pairs = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+        case 'c':
+            cc_count = 0;
+            for (char *name = strtok(optarg, ","); name != NULL && cc_count < MAX_CC_NAMES; name = strtok(NULL, ","))
+            {
+                if (mtp_cc_find(name) < 0)
+                {
+                    printf("Unknown congestion control algorithm: %s\n", name);
+                    exit(1);
+                }
+                cc_names[cc_count++] = name;
+            }
+            break;
+        default:
+            printf("Usage: mtp_bench <mode> [-n max_pairs] [-d seconds] [-s message_size] [-p base_port] [-c algo,...] [-z | -w | -b batch] [-e] [-r rate] [-P loss] [-j] [-H]\n");
+            exit(1);
+        }
+    }
+    if (zero_copy + stream + (batch != 0) > 1)
+    {
+        printf("Only one of -z, -w and -b can be used\n");
+        exit(1);
+    }
+    if (batch < 0 || batch > MAX_BATCH)
+    {
+        printf("Batch size must be between 1 and %d\n", MAX_BATCH);
+        exit(1);
+    }
+    if (msg_size < 1 || msg_size > MESSAGE_SIZE)
+    {
+        printf("Message size must be between 1 and %d\n", MESSAGE_SIZE);
+        exit(1);
+    }
+    // the size of the socket table is set by initmsocket -n, m_socket fails with ENOBUFS past it
+    if (max_pairs < 1)
+    {
+        printf("Number of pairs must be at least 1\n");
+        exit(1);
+    }
+    if (rate < 0)
+    {
+        printf("Rate must be at least 0 (0 to saturate)\n");
+        exit(1);
+    }
+}
@@ -0,0 +1,167 @@
+/**
+ * @file mtp_cc.c
+ *
+ * @brief Congestion control algorithms of the MTP sockets: Reno (AIMD), CUBIC (RFC 8312) and a Vegas style
+ * delay-based algorithm. Windows are counted in messages and kept between 1 and MAX_WINDOW_SIZE.
+ * The documentation for the functions can be found in documentation.txt
+*/
+#include <msocket.h>
+#include <math.h>
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+
+// keep the window between 1 message and the largest window the receiver can advertise
+void cc_clamp(mtp_cc *cc)
+{
+    if (cc->cwnd < 1)
+        cc->cwnd = 1;
+    if (cc->cwnd > MAX_WINDOW_SIZE)
+        cc->cwnd = MAX_WINDOW_SIZE;
+    if (cc->ssthresh < 2)
+        cc->ssthresh = 2;
+}
+
+// ------------------------------------------ Reno ------------------------------------------
+void reno_init(mtp_cc *cc)
+{
+    int algo = cc->algo;
+    memset(cc, 0, sizeof(mtp_cc));
+    cc->algo = algo;
+    cc->cwnd = CC_INITIAL_CWND;
+    cc->ssthresh = CC_INITIAL_SSTHRESH < MAX_WINDOW_SIZE ? CC_INITIAL_SSTHRESH : MAX_WINDOW_SIZE;
+}
+
+// slow start doubles the window every RTT, congestion avoidance adds one message per RTT
+void reno_on_ack(mtp_cc *cc, int acked, long long rtt, long long srtt, long long now)
+{
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd += acked;
+    else
+        cc->cwnd += (double)acked / cc->cwnd;
+    cc_clamp(cc);
+}
+
+void reno_on_loss(mtp_cc *cc, long long now)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    cc->cwnd = cc->ssthresh;
+    cc->losses++;
+    cc_clamp(cc);
+}
+
+void reno_on_timeout(mtp_cc *cc, long long now)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    cc->cwnd = 1;
+    cc->losses++;
+    cc_clamp(cc);
+}
+
+// ------------------------------------------ CUBIC ------------------------------------------
+// the window grows as W(t) = C (t - K)^3 + w_max from the last reduction, and never slower than Reno would
+void cubic_on_ack(mtp_cc *cc, int acked, long long rtt, long long srtt, long long now)
+{
+    if (cc->cwnd < cc->ssthresh)
+    {
+        cc->cwnd += acked;
+        cc_clamp(cc);
+        return;
+    }
+    if (cc->epoch == 0)
+    {
+        cc->epoch = now;
+        if (cc->w_max < cc->cwnd)
+        {
+            cc->w_max = cc->cwnd;
+            cc->k = 0;
+        }
+        else
+        {
+            cc->k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+        }
+    }
+    double t = (now - cc->epoch) / 1e6;
+    double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+
+    // TCP friendly region: the window Reno would have reached in the same number of RTTs
+    if (srtt > 0)
+    {
+        double w_est = cc->w_max * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (t * 1e6 / srtt);
+        if (w_est > target)
+            target = w_est;
+    }
+    if (target > cc->cwnd)
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    else
+        cc->cwnd += 0.01 * acked / cc->cwnd;
+    cc_clamp(cc);
+}
+
+void cubic_on_loss(mtp_cc *cc, long long now)
+{
+    cc->w_max = cc->cwnd;
+    cc->cwnd = cc->cwnd * CUBIC_BETA;
+    cc->ssthresh = cc->cwnd;
+    cc->epoch = 0;
+    cc->losses++;
+    cc_clamp(cc);
+}
+
+void cubic_on_timeout(mtp_cc *cc, long long now)
+{
+    cubic_on_loss(cc, now);
+    cc->cwnd = 1;
+    cc_clamp(cc);
+}
+
+// ------------------------------------------ Vegas ------------------------------------------
+// keep between VEGAS_ALPHA and VEGAS_BETA messages queued in the path: the difference between the expected
+// (cwnd / base_rtt) and the actual (cwnd / rtt) rate, times base_rtt
+void vegas_on_ack(mtp_cc *cc, int acked, long long rtt, long long srtt, long long now)
+{
+    if (rtt > 0 && (cc->base_rtt == 0 || rtt < cc->base_rtt))
+        cc->base_rtt = rtt;
+    if (rtt <= 0 || cc->base_rtt == 0)
+    {
+        reno_on_ack(cc, acked, rtt, srtt, now);
+        return;
+    }
+    double queued = cc->cwnd * (rtt - cc->base_rtt) / rtt;
+    if (cc->cwnd < cc->ssthresh && queued < 1)
+        cc->cwnd += acked;
+    else if (queued < VEGAS_ALPHA)
+        cc->cwnd += (double)acked / cc->cwnd;
+    else if (queued > VEGAS_BETA)
+        cc->cwnd -= (double)acked / cc->cwnd;
+    if (queued >= 1 && cc->ssthresh > cc->cwnd)
+        cc->ssthresh = cc->cwnd;
+    cc_clamp(cc);
+}
+
+void vegas_on_loss(mtp_cc *cc, long long now)
+{
+    cc->ssthresh = cc->cwnd * 3 / 4;
+    cc->cwnd = cc->ssthresh;
+    cc->losses++;
+    cc_clamp(cc);
+}
+
+// ------------------------------------------ Registry ------------------------------------------
+const mtp_cc_ops cc_reno = {"reno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout};
+const mtp_cc_ops cc_cubic = {"cubic", reno_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout};
+const mtp_cc_ops cc_vegas = {"vegas", reno_init, vegas_on_ack, vegas_on_loss, reno_on_timeout};
+
+const mtp_cc_ops *mtp_cc_algos[CC_COUNT] = {&cc_reno, &cc_cubic, &cc_vegas};
+
+int mtp_cc_find(const char *name)
+{
+    for (int i = 0; i < CC_COUNT; i++)
+    {
+        if (strcmp(mtp_cc_algos[i]->name, name) == 0)
+            return i;
+    }
+    return -1;
+}
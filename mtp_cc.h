@@ -0,0 +1,59 @@
+/**
+ * @file mtp_cc.h
+ *
+ * @brief Congestion control of the MTP sockets.
+ * Every MTP socket has a congestion window (cwnd, in messages) kept by the worker threads of initmsocket.
+ * The algorithm is chosen per socket with m_setcc() and is called through a small table of operations,
+ * so a new algorithm only needs an mtp_cc_ops entry in mtp_cc.c.
+ * The documentation for the functions can be found in documentation.txt
+*/
+#ifndef _MTP_CC_H
+#define _MTP_CC_H
+
+// Congestion control algorithms
+#define CC_RENO 0
+#define CC_CUBIC 1
+#define CC_VEGAS 2
+#define CC_COUNT 3
+
+#define CC_INITIAL_CWND 2
+// the first slow start ends there (or at MAX_WINDOW_SIZE if smaller) and congestion avoidance probes further:
+// doubling up to a window of 1024 messages would overrun the UDP receive buffer of the peer in one RTT
+#define CC_INITIAL_SSTHRESH 64
+
+// Structure for the congestion control state of an MTP socket, lives in the shared MTP socket entry
+typedef struct mtp_cc
+{
+    int algo;             // CC_RENO, CC_CUBIC or CC_VEGAS
+    double cwnd;          // congestion window in messages
+    double ssthresh;      // slow start threshold in messages
+    double w_max;         // CUBIC: window before the last reduction
+    double k;             // CUBIC: time in seconds to grow back to w_max
+    long long epoch;      // CUBIC: start of the current growth epoch (CLOCK_MONOTONIC us), 0 if none
+    long long base_rtt;   // Vegas: smallest RTT seen in us, 0 if none
+    int losses;           // number of window reductions
+} mtp_cc;
+
+// Structure for the operations of a congestion control algorithm
+// All of them are called by initmsocket with the lock of the MTP socket held
+typedef struct mtp_cc_ops
+{
+    const char *name;
+    // reset the state for a new socket
+    void (*init)(mtp_cc *cc);
+    // acked messages were newly acknowledged; rtt is the RTT sample of this ACK in us (-1 if none), srtt the smoothed RTT
+    void (*on_ack)(mtp_cc *cc, int acked, long long rtt, long long srtt, long long now);
+    // a loss was detected by duplicate ACKs
+    void (*on_loss)(mtp_cc *cc, long long now);
+    // the retransmission timer of the oldest message expired
+    void (*on_timeout)(mtp_cc *cc, long long now);
+} mtp_cc_ops;
+
+// Table of the algorithms, indexed by mtp_cc.algo
+extern const mtp_cc_ops *mtp_cc_algos[CC_COUNT];
+
+// Function to find an algorithm by name ("reno", "cubic", "vegas")
+// Returns its index, -1 if there is none
+int mtp_cc_find(const char *name);
+
+#endif
@@ -0,0 +1,1529 @@
+/**
+ * @file mtp_engine.c
+ *
+ * @brief Protocol engine of the MTP sockets, run by initmsocket for the applications of the host or embedded in an
+ * application with m_embed().
+ * It creates the worker threads (one by default) and, in initmsocket, G.
+ * Worker w owns the MTP sockets i with i % workers == w: it alone sends and receives on their UDP sockets,
+ * with its own epoll instance, timer wheel and datagram batches, so that the workers share no lock on the fast path.
+ *
+ * A worker sends the messages of its sockets to the receiver using the corresponding UDP socket.
+ * It sets a timer for the message and waits for an ACK message from the receiver.
+ *
+ * A worker also receives the messages of its sockets from the sender.
+ * It checks whether the message is a data message or an ACK message.
+ * If it is a data message, it stores the message in the receive buffer.
+ * If it is an ACK message, it updates the sender window and sends an ACK message to the sender.
+ *
+ * The garbage collector thread checks whether the process corresponding to any of the MTP sockets is still alive or not.
+ * If the process is not alive, it cleans up the MTP socket.
+ *
+ * handle_request creates, binds and closes the UDP sockets of the MTP sockets.
+ * The documentation for the functions can be found in documentation.txt
+*/
+#define _GNU_SOURCE // sendmmsg and recvmmsg
+#include <mtp_engine.h>
+#include <mtp_trace.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+// ready sockets handled per epoll_wait of a worker
+#define R_MAX_EVENTS 64
+
+// epoll tags of the wakeup socket and of the timer of a worker, the UDP sockets are tagged with their MTP socket index
+#define DOORBELL_TAG UINT32_MAX
+#define TIMER_TAG (UINT32_MAX - 1)
+
+mtp_socket *SM;
+mtp_control *ctrl;
+
+pthread_t G_thread;
+
+// size of the MTP socket table, set with -n
+int max_sockets = MAX_SOCKETS;
+
+// number of worker threads, set with -w, and whether worker w is pinned to CPU w, set with -a
+int num_workers = 1;
+int pin_workers = 0;
+
+// set with -q in initmsocket, off in an embedded engine
+// the datagrams are not printed, they are recorded in the binary trace (see mtp_trace.h)
+int engine_debug = 1;
+
+// ------------------------------------------ Utility Functions ------------------------------------------
+// lock the entry of MTP socket i
+void lock_socket(int i)
+{
+    if (m_entry_lock(&SM[i]))
+        printf(YELLOW "[lock] the owner of the lock of MTP socket %d died, lock recovered\n" RESET, i);
+}
+
+// unlock the entry of MTP socket i
+void unlock_socket(int i)
+{
+    m_entry_unlock(&SM[i]);
+}
+
+/*
+Write the MTP header h in network byte order into the first MESSAGE_HEADER_SIZE bytes of buffer
+    header: version(8) flags(8) window(16) seq(32) ack(32) len(16) reserved(16)
+*/
+void get_header(char *buffer, const mtp_header *h)
+{
+    mtp_header wire;
+    wire.version = MTP_VERSION;
+    wire.flags = h->flags;
+    wire.window = htons(h->window);
+    wire.seq = htonl(h->seq);
+    wire.ack = htonl(h->ack);
+    wire.len = htons(h->len);
+    wire.reserved = 0;
+    memcpy(buffer, &wire, MESSAGE_HEADER_SIZE);
+}
+
+/*
+Read the MTP header at the start of buffer into h in host byte order
+    the caller checks that the datagram holds a full header and the version
+*/
+void process_header(const char *buffer, mtp_header *h)
+{
+    memcpy(h, buffer, MESSAGE_HEADER_SIZE);
+    h->window = ntohs(h->window);
+    h->seq = ntohl(h->seq);
+    h->ack = ntohl(h->ack);
+    h->len = ntohs(h->len);
+}
+
+// ------------------------------------------ Batched I/O ------------------------------------------
+/*
+Datagrams are sent in batches with one sendmmsg: every worker queues its datagrams in its own tx_batch
+    a batch only holds datagrams of the MTP socket whose lock the thread holds, and is flushed before the lock
+    is released, as the UDP socket of a closed MTP socket is closed and its descriptor reused
+    a datagram is gathered from its header and its payload, which for a data message is its send buffer entry
+A worker reads the datagrams of a socket in batches of IO_BATCH with one recvmmsg
+    the payloads are scattered into the free receive buffer entries of the next messages in order, so that
+    a message that arrives in order is stored without a copy (see rx_target)
+*/
+#define IO_BATCH 64
+
+typedef struct tx_batch
+{
+    int fd;    // UDP socket of the queued datagrams
+    int count; // number of queued datagrams
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec iov[IO_BATCH][2]; // header and payload
+    struct sockaddr_in addr[IO_BATCH];
+    char header[IO_BATCH][MESSAGE_HEADER_SIZE];
+    char sack[IO_BATCH][SACK_BITMAP_SIZE]; // payload of the ACKs
+} tx_batch;
+
+typedef struct rx_batch
+{
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec iov[IO_BATCH][2]; // header and payload
+    char header[IO_BATCH][MESSAGE_HEADER_SIZE];
+    char payload[IO_BATCH][MESSAGE_SIZE]; // payloads that have no receive buffer entry to go to
+} rx_batch;
+
+// send the queued datagrams, returns the number sent
+int tx_flush(tx_batch *tx)
+{
+    int sent = 0;
+    while (sent < tx->count)
+    {
+        int n = sendmmsg(tx->fd, tx->msgs + sent, tx->count - sent, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // the rest is lost, the retransmission timers recover the data messages
+            pperror("[daemon] sendmmsg failed");
+            break;
+        }
+        sent += n;
+    }
+    tx->count = 0;
+    return sent;
+}
+
+// room for the header of the next datagram to the peer of MTP socket i, the batch is flushed first if it is full
+char *tx_queue(tx_batch *tx, int i)
+{
+    if (tx->count == IO_BATCH || (tx->count > 0 && tx->fd != SM[i].udp_sock))
+        tx_flush(tx);
+    tx->fd = SM[i].udp_sock;
+    struct sockaddr_in *addr = &tx->addr[tx->count];
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(SM[i].dest_port);
+    inet_aton(SM[i].dest_ip, &addr->sin_addr);
+    return tx->header[tx->count];
+}
+
+// the datagram whose header was written at tx_queue is complete, with the payload of len bytes at payload
+// the payload is sent from where it is, it must stay unchanged until the batch is flushed
+void tx_commit(tx_batch *tx, const char *payload, int len)
+{
+    int k = tx->count++;
+    tx->iov[k][0].iov_base = tx->header[k];
+    tx->iov[k][0].iov_len = MESSAGE_HEADER_SIZE;
+    tx->iov[k][1].iov_base = (void *)payload;
+    tx->iov[k][1].iov_len = len;
+    memset(&tx->msgs[k], 0, sizeof(struct mmsghdr));
+    tx->msgs[k].msg_hdr.msg_name = &tx->addr[k];
+    tx->msgs[k].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    tx->msgs[k].msg_hdr.msg_iov = tx->iov[k];
+    tx->msgs[k].msg_hdr.msg_iovlen = 2;
+}
+
+void rx_init(rx_batch *rx)
+{
+    for (int k = 0; k < IO_BATCH; k++)
+    {
+        rx->iov[k][0].iov_base = rx->header[k];
+        rx->iov[k][0].iov_len = MESSAGE_HEADER_SIZE;
+        rx->iov[k][1].iov_len = MESSAGE_SIZE;
+        memset(&rx->msgs[k], 0, sizeof(struct mmsghdr));
+        rx->msgs[k].msg_hdr.msg_iov = rx->iov[k];
+        rx->msgs[k].msg_hdr.msg_iovlen = 2;
+    }
+}
+
+/*
+Point the payload of the k-th datagram of the next recvmmsg on MTP socket i at the receive buffer entry of message
+rwnd.next + k if that entry is free, and at the scratch payload of the batch otherwise
+    free entries hold no message, so writing into them is harmless whatever the datagrams turn out to be
+    the caller holds the lock of MTP socket i until the batch is processed
+*/
+void rx_target(rx_batch *rx, int i)
+{
+    for (int k = 0; k < IO_BATCH; k++)
+    {
+        uint32_t seq = SM[i].rwnd.next + k;
+        int j = RECEIVE_SLOT(seq);
+        if (SEQ_LT(seq, SM[i].rwnd.base + MAX_RECEIVE_BUFFER_SIZE) && SM[i].receive_len[j] == 0)
+            rx->iov[k][1].iov_base = SM[i].receive_buffer[j];
+        else
+            rx->iov[k][1].iov_base = rx->payload[k];
+    }
+}
+
+/*
+Payload of the k-th datagram of n bytes received on MTP socket i
+    only a data message that landed in its own receive buffer entry stays there; every other payload that landed in
+    an entry is moved to the scratch payload, as an earlier datagram of the batch may store its message in that entry
+*/
+char *rx_payload(rx_batch *rx, int i, int k, int n)
+{
+    char *payload = rx->iov[k][1].iov_base;
+    if (payload == rx->payload[k] || n <= MESSAGE_HEADER_SIZE)
+        return payload;
+    mtp_header h;
+    process_header(rx->header[k], &h);
+    if (rx->header[k][0] == MTP_VERSION && !(h.flags & MTP_FLAG_ACK) && payload == SM[i].receive_buffer[RECEIVE_SLOT(h.seq)])
+        return payload;
+    memcpy(rx->payload[k], payload, n - MESSAGE_HEADER_SIZE);
+    return rx->payload[k];
+}
+
+/*
+Send an ACK of MTP socket i carrying the current receive window
+    ack is cumulative (every message before rwnd.next), followed by a SACK bitmap of the messages received
+    out of order: bit k (byte k / 8, bit k % 8) stands for message rwnd.next + 1 + k
+    seq is the data message that triggered the ACK (0 for window updates), the sender takes its RTT sample from it
+    the ACK is queued in tx, the caller holds the lock of MTP socket i
+*/
+void send_ack(tx_batch *tx, int i, uint32_t seq)
+{
+    char *buffer = tx_queue(tx, i);
+    char *sack = tx->sack[tx->count];
+    memset(sack, 0, SACK_BITMAP_SIZE);
+    int len = 0;
+    uint32_t end = SM[i].rwnd.base + MAX_RECEIVE_BUFFER_SIZE;
+    if (SEQ_GT(end, SM[i].rwnd.next + 1 + SACK_BITMAP_SIZE * 8))
+        end = SM[i].rwnd.next + 1 + SACK_BITMAP_SIZE * 8;
+    for (uint32_t s = SM[i].rwnd.next + 1; SEQ_LT(s, end); s++)
+    {
+        if (SM[i].receive_len[RECEIVE_SLOT(s)] != 0)
+        {
+            int k = (int)(s - SM[i].rwnd.next - 1);
+            sack[k / 8] |= 1 << (k % 8);
+            len = k / 8 + 1;
+        }
+    }
+
+    mtp_header h = {0};
+    h.flags = MTP_FLAG_ACK;
+    h.window = SM[i].rwnd.size;
+    h.seq = seq;
+    h.ack = SM[i].rwnd.next - 1;
+    h.len = len;
+    get_header(buffer, &h);
+    tx_commit(tx, sack, len);
+    SM[i].counters.acks_sent++;
+    TRACE(TRACE_ACK, seq != 0 ? TR_ACK_SENT : TR_WINDOW_UPDATE, i, h.ack, h.window, seq);
+}
+
+/*
+DUPLICATE ACK MESSAGE WITH THE LAST ACKNOWLEDGED SEQUENCE NUMBER BUT WITH THE UPDATED RWND SIZE
+    the caller holds the lock of MTP socket i
+*/
+void send_window_update(tx_batch *tx, int i)
+{
+    send_ack(tx, i, 0);
+    SM[i].window_update = 0;
+}
+
+// current CLOCK_MONOTONIC time in milliseconds
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// current CLOCK_MONOTONIC time in microseconds
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ------------------------------------------ Retransmission Timeout ------------------------------------------
+// bounds of the retransmission timeout in ms, set with -m and -M
+int rto_min = RTO_MIN;
+int rto_max = RTO_MAX;
+
+// probability of dropping a received datagram, set with -p
+float drop_prob = P;
+
+// duplicate ACKs that trigger a fast retransmission, set with -d (0 disables fast retransmit)
+int dup_ack_threshold = DUP_ACK_THRESHOLD;
+
+// number of messages a worker may have outstanding from swnd.base: the receiver window capped by the congestion window
+// the caller holds the lock of MTP socket i
+int send_window(int i)
+{
+    int cwnd = (int)SM[i].cc.cwnd;
+    return SM[i].swnd.size < cwnd ? SM[i].swnd.size : cwnd;
+}
+
+// ------------------------------------------ Bottleneck ------------------------------------------
+/*
+Token bucket shared by every MTP socket, emulating a rate-limited path with -r rate_kBps and -b burst_kB
+    a data datagram that finds less than its size in the bucket is dropped, as by a drop-tail queue of burst_kB
+    (without the queueing delay); ACKs are not limited
+    the bucket is shared by the workers, its mutex is only taken when there is a bottleneck
+*/
+double bottleneck_rate = 0; // bytes per us, 0 when there is no bottleneck
+double bottleneck_burst = 0;
+double bottleneck_tokens = 0;
+long long bottleneck_time = 0;
+pthread_mutex_t bottleneck_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the caller holds bottleneck_mutex
+int bottleneck_take(int bytes)
+{
+    long long now = now_us();
+    bottleneck_tokens += (now - bottleneck_time) * bottleneck_rate;
+    if (bottleneck_tokens > bottleneck_burst)
+        bottleneck_tokens = bottleneck_burst;
+    bottleneck_time = now;
+    if (bottleneck_tokens < bytes)
+        return 0;
+    bottleneck_tokens -= bytes;
+    return 1;
+}
+
+int bottleneck_admit(int bytes)
+{
+    if (bottleneck_rate == 0)
+        return 1;
+    pthread_mutex_lock(&bottleneck_mutex);
+    int admit = bottleneck_take(bytes);
+    pthread_mutex_unlock(&bottleneck_mutex);
+    return admit;
+}
+
+int clamp_rto(long long rto)
+{
+    if (rto < rto_min)
+        return rto_min;
+    if (rto > rto_max)
+        return rto_max;
+    return (int)rto;
+}
+
+// RTO = SRTT + max(1 ms, 4 RTTVAR) of MTP socket i, RTO_INITIAL before the first sample
+int rto_estimate(int i)
+{
+    if (SM[i].srtt == 0)
+        return clamp_rto(RTO_INITIAL);
+    long long var = 4 * SM[i].rttvar > 1000 ? 4 * SM[i].rttvar : 1000;
+    // round up to the 1 ms resolution of the timer wheel
+    return clamp_rto((SM[i].srtt + var + 999) / 1000);
+}
+
+/*
+Update the RTT estimate of MTP socket i with a new sample (Jacobson/Karels, RFC 6298)
+    SRTT = 7/8 SRTT + 1/8 R, RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, RTO = SRTT + max(1 ms, 4 RTTVAR)
+    the caller holds the lock of MTP socket i
+*/
+void rtt_sample(int i, long long rtt)
+{
+    if (rtt < 0)
+        return;
+    SM[i].counters.rtt_samples++;
+    if (SM[i].counters.min_rtt == 0 || rtt < SM[i].counters.min_rtt)
+        SM[i].counters.min_rtt = rtt;
+    if (SM[i].srtt == 0)
+    {
+        SM[i].srtt = rtt;
+        SM[i].rttvar = rtt / 2;
+    }
+    else
+    {
+        long long err = SM[i].srtt > rtt ? SM[i].srtt - rtt : rtt - SM[i].srtt;
+        SM[i].rttvar = (3 * SM[i].rttvar + err) / 4;
+        SM[i].srtt = (7 * SM[i].srtt + rtt) / 8;
+    }
+    TRACE(TRACE_ACK, TR_RTT, i, 0, (int)rtt, (int)SM[i].srtt);
+    SM[i].rto = rto_estimate(i);
+    SM[i].rto_backoff = 0;
+}
+
+/*
+Queue message seq of MTP socket i in tx and record the transmission time
+    the caller holds the lock of MTP socket i and flushes tx before releasing it
+    returns 0 on success, -1 on failure
+*/
+int transmit(tx_batch *tx, int i, uint32_t seq)
+{
+    int j = SEND_SLOT(seq);
+    char *buffer = tx_queue(tx, i);
+    mtp_header h = {0};
+    h.window = SM[i].rwnd.size;
+    h.seq = seq;
+    h.len = SM[i].send_len[j];
+    get_header(buffer, &h);
+    // the payload goes out of the send buffer entry, which m_sendto leaves alone until the message is acknowledged
+    tx_commit(tx, SM[i].send_buffer[j], h.len);
+    SM[i].send_time[j] = now_us();
+    SM[i].send_tx_count[j]++;
+    return 0;
+}
+
+// retransmit message seq of MTP socket i from the ACK path, without waiting for its timer
+int fast_retransmit(tx_batch *tx, int i, uint32_t seq)
+{
+    if (transmit(tx, i, seq) != 0)
+        return -1;
+    SM[i].counters.retransmissions++;
+    SM[i].counters.fast_retransmissions++;
+    TRACE(TRACE_LOSS, TR_FAST_RETRANSMIT, i, seq, SM[i].dup_acks, (int)SM[i].cc.cwnd);
+    return 0;
+}
+
+/*
+SACK-based loss recovery of MTP socket i (RFC 6675) on an ACK that acknowledged messages up to high - 1,
+the latest of them transmitted at acked_time
+    a message of swnd.base .. high - 1 that is still unacknowledged is lost once dup_ack_threshold messages after it
+    are acknowledged, unless it was retransmitted after acked_time (that copy may still be in flight);
+    the lost messages inside the window are retransmitted at once, the first loss starts a recovery (see handle_datagram)
+    the caller holds the lock of MTP socket i and flushes tx before releasing it
+*/
+void sack_recovery(tx_batch *tx, int i, uint32_t high, long long acked_time)
+{
+    if (!SEQ_GT(high, SM[i].swnd.base))
+        return;
+    int sacked = 0;
+    for (uint32_t s = SM[i].swnd.base; SEQ_LT(s, high); s++)
+    {
+        if (SM[i].send_len[SEND_SLOT(s)] == 0)
+            sacked++;
+    }
+    // send_window(i) is evaluated again as on_loss reduces cwnd
+    for (uint32_t s = SM[i].swnd.base; SEQ_LT(s, high) && SEQ_LT(s, SM[i].swnd.base + send_window(i)) && sacked >= dup_ack_threshold; s++)
+    {
+        int j = SEND_SLOT(s);
+        if (SM[i].send_len[j] == 0)
+        {
+            sacked--;
+        }
+        else if (SM[i].send_time[j] < acked_time)
+        {
+            if (!SM[i].in_recovery)
+            {
+                SM[i].in_recovery = 1;
+                SM[i].recover = SM[i].swnd.next - 1;
+                mtp_cc_algos[SM[i].cc.algo]->on_loss(&SM[i].cc, now_us());
+            }
+            fast_retransmit(tx, i, s);
+        }
+    }
+}
+
+// ------------------------------------------ Timer Wheel ------------------------------------------
+/*
+Hashed timer wheel of a worker thread, one timer per message in flight on the MTP sockets of its shard.
+    WHEEL_SLOTS buckets of 1 ms, a timer further than WHEEL_SLOTS ms away stays in its bucket for several turns.
+    m_sendto never lets two messages in flight share a send buffer entry,
+    so the timer of message seq of socket i is the fixed node (i / workers) * SEND_RING_SIZE + SEND_SLOT(seq).
+    Every socket also has a persist timer, node shard * SEND_RING_SIZE + i / workers, armed while the peer
+    window is closed and messages wait to be sent (see persist_fire).
+    Timers are cancelled lazily: when a timer fires for a message that has been acknowledged it is dropped,
+    and a message that was retransmitted meanwhile (send_time moved) is re-armed to its new deadline.
+*/
+#define WHEEL_SLOTS 1024
+
+typedef struct wheel_timer
+{
+    int prev, next; // links in the bucket list, -1 terminated
+    int linked;
+    int sock;
+    uint32_t seq;
+    long long expires; // CLOCK_MONOTONIC ms
+} wheel_timer;
+
+typedef struct timer_wheel
+{
+    wheel_timer *timers;    // one per send buffer entry of every MTP socket of the shard, then one persist timer per socket
+    int persist;            // node of the persist timer of the first socket of the shard
+    int wheel[WHEEL_SLOTS]; // first timer of each bucket, -1 if empty
+    long long time;         // every timer up to this ms has been processed
+    int count;              // number of armed timers
+} timer_wheel;
+
+void wheel_init(timer_wheel *tw, int shard, long long now)
+{
+    for (int b = 0; b < WHEEL_SLOTS; b++)
+    {
+        tw->wheel[b] = -1;
+    }
+    tw->timers = calloc((size_t)shard * (SEND_RING_SIZE + 1), sizeof(wheel_timer));
+    if (tw->timers == NULL)
+    {
+        pperror("[worker] calloc timers failed");
+        exit(EXIT_FAILURE);
+    }
+    tw->persist = shard * SEND_RING_SIZE;
+    tw->time = now;
+    tw->count = 0;
+}
+
+void wheel_unlink(timer_wheel *tw, int t)
+{
+    wheel_timer *timers = tw->timers;
+    if (!timers[t].linked)
+        return;
+    if (timers[t].prev != -1)
+        timers[timers[t].prev].next = timers[t].next;
+    else
+        tw->wheel[timers[t].expires % WHEEL_SLOTS] = timers[t].next;
+    if (timers[t].next != -1)
+        timers[timers[t].next].prev = timers[t].prev;
+    timers[t].linked = 0;
+    tw->count--;
+}
+
+void wheel_link(timer_wheel *tw, int t, long long expires)
+{
+    wheel_timer *timers = tw->timers;
+    // a timer in the past fires on the next advance
+    if (expires <= tw->time)
+        expires = tw->time + 1;
+    timers[t].expires = expires;
+    int b = expires % WHEEL_SLOTS;
+    timers[t].prev = -1;
+    timers[t].next = tw->wheel[b];
+    if (tw->wheel[b] != -1)
+        timers[tw->wheel[b]].prev = t;
+    tw->wheel[b] = t;
+    timers[t].linked = 1;
+    tw->count++;
+}
+
+// (re)start the timer of message seq of MTP socket i
+void wheel_arm(timer_wheel *tw, int i, uint32_t seq, long long expires)
+{
+    int t = i / num_workers * SEND_RING_SIZE + SEND_SLOT(seq);
+    wheel_unlink(tw, t);
+    tw->timers[t].sock = i;
+    tw->timers[t].seq = seq;
+    wheel_link(tw, t, expires);
+}
+
+// start the persist timer of MTP socket i, due in SM[i].persist ms
+void persist_arm(timer_wheel *tw, int i, long long now)
+{
+    int t = tw->persist + i / num_workers;
+    wheel_unlink(tw, t);
+    tw->timers[t].sock = i;
+    wheel_link(tw, t, now + SM[i].persist);
+}
+
+// the peer window of MTP socket i is closed while messages are in flight or wait in the send buffer
+// the caller holds the lock of MTP socket i
+int window_stalled(int i)
+{
+    return SM[i].swnd.size == 0 && SM[i].swnd.base != SM[i].num_messages_sent + 1;
+}
+
+/*
+The persist timer of MTP socket i expired: while the peer window is closed, send one message into it (zero window
+probe, RFC 9293), the oldest one in flight or else the next one without moving swnd.next, so that the window reopens
+even if the update that reopened it was lost; the receiver acknowledges it with its current window, whether it stores
+it or not. The interval starts at the RTO and doubles up to the largest RTO.
+    queued in tx, the caller holds the lock of MTP socket i
+*/
+void persist_fire(timer_wheel *tw, tx_batch *tx, int i, long long now)
+{
+    if (SM[i].persist == 0)
+        return;
+    if (!window_stalled(i))
+    {
+        SM[i].persist = 0;
+        return;
+    }
+    uint32_t seq = SM[i].swnd.base != SM[i].swnd.next ? SM[i].swnd.base : SM[i].swnd.next;
+    if (transmit(tx, i, seq) == 0)
+    {
+        SM[i].counters.window_probes++;
+        SM[i].persist = clamp_rto(2LL * SM[i].persist);
+        TRACE(TRACE_LOSS, TR_WINDOW_PROBE, i, seq, SM[i].persist, 0);
+    }
+    persist_arm(tw, i, now);
+}
+
+// a timer expired: retransmit its message if it is still unacknowledged, queued in tx
+void wheel_fire(timer_wheel *tw, tx_batch *tx, int t, long long now)
+{
+    int i = tw->timers[t].sock;
+    lock_socket(i);
+    if (SM[i].is_free == 0 && t >= tw->persist)
+    {
+        persist_fire(tw, tx, i, now);
+    }
+    else if (SM[i].is_free == 0)
+    {
+        uint32_t seq = tw->timers[t].seq;
+        int j = SEND_SLOT(seq);
+        if (SEQ_GEQ(seq, SM[i].swnd.base) && SEQ_LT(seq, SM[i].swnd.next) && SM[i].send_len[j] != 0)
+        {
+            long long expires = SM[i].send_time[j] / 1000 + SM[i].rto;
+            if (expires <= now)
+            {
+                // only retransmit inside the window, otherwise the receiver has no room for the message
+                if (SEQ_LT(seq, SM[i].swnd.base + send_window(i)) && transmit(tx, i, seq) == 0)
+                {
+                    // exponential backoff, once per timeout of the oldest message so that a window of messages
+                    // timing out together backs off only once, and again only if the base has not moved since
+                    // the last backoff; the next RTT sample or an ACK of the message restores the estimate
+                    if (seq == SM[i].swnd.base)
+                    {
+                        if (!SM[i].rto_backoff || SM[i].rto_backoff_base == seq)
+                            SM[i].rto = clamp_rto(2LL * SM[i].rto);
+                        SM[i].rto_backoff = 1;
+                        SM[i].rto_backoff_base = seq;
+                        mtp_cc_algos[SM[i].cc.algo]->on_timeout(&SM[i].cc, now_us());
+                        // the duplicate ACKs of the messages in flight must not reduce cwnd again
+                        SM[i].in_recovery = 1;
+                        SM[i].recover = SM[i].swnd.next - 1;
+                        SM[i].counters.timeouts++;
+                        TRACE(TRACE_LOSS, TR_TIMEOUT, i, seq, SM[i].rto, (int)SM[i].cc.cwnd);
+                    }
+                    SM[i].counters.retransmissions++;
+                    TRACE(TRACE_LOSS, TR_RETRANSMIT, i, seq, SM[i].send_tx_count[j], SM[i].rto);
+                }
+                expires = now + SM[i].rto;
+            }
+            wheel_link(tw, t, expires);
+        }
+    }
+    tx_flush(tx);
+    unlock_socket(i);
+}
+
+// fire every timer that expired up to now
+void wheel_advance(timer_wheel *tw, tx_batch *tx, long long now)
+{
+    if (now <= tw->time)
+        return;
+    // after a long sleep every bucket is visited once
+    long long from = now - tw->time > WHEEL_SLOTS ? now - WHEEL_SLOTS : tw->time;
+    tw->time = now;
+    for (long long tick = from + 1; tick <= now && tw->count > 0; tick++)
+    {
+        int t = tw->wheel[tick % WHEEL_SLOTS];
+        while (t != -1)
+        {
+            int next = tw->timers[t].next;
+            if (tw->timers[t].expires <= now)
+            {
+                wheel_unlink(tw, t);
+                wheel_fire(tw, tx, t, now);
+            }
+            t = next;
+        }
+    }
+}
+
+// time of the next bucket holding a timer, -1 if there is none
+long long wheel_next_expiry(timer_wheel *tw)
+{
+    if (tw->count == 0)
+        return -1;
+    for (long long tick = tw->time + 1; tick <= tw->time + WHEEL_SLOTS; tick++)
+    {
+        if (tw->wheel[tick % WHEEL_SLOTS] != -1)
+            return tick;
+    }
+    return tw->time + WHEEL_SLOTS;
+}
+
+// ------------------------------------------ Workers ------------------------------------------
+/*
+State of a worker thread, only touched by the holder of run once the worker runs, apart from epoll_fd
+    main adds a UDP socket to the epoll instance of its worker at bind time, main and G remove it at close time
+    the worker holds run except while it sleeps in epoll_wait, when the application threads of an embedded engine
+    may take it to do its work (see engine_kick)
+*/
+typedef struct worker
+{
+    int id;
+    pthread_t thread;
+    pthread_mutex_t run;
+    int epoll_fd;        // UDP sockets of the shard, tagged with their MTP socket index, and the wakeup socket
+    int doorbell_fd;     // wakeup socket, bound to m_worker_addr(id), applications write to it in m_doorbell
+    int timer_fd;        // wakes the worker for a retransmission timer armed by engine_kick
+    long long wake_at;   // time the sleeping worker wakes up at, CLOCK_MONOTONIC ms
+    int shard;           // number of MTP sockets of the shard
+    int *ready;          // sockets taken from the ready bitmap of the worker
+    long long next_update; // time of the next periodic window update, CLOCK_MONOTONIC ms
+    int stop;            // set by workers_stop, the worker exits when it wakes up
+    timer_wheel tw;
+    tx_batch tx;
+    rx_batch rx;
+} worker;
+
+worker *workers;
+
+// ------------------------------------------ Threads ------------------------------------------
+
+// Send the new work of the sockets of worker wk whose doorbell was rung
+// New messages are sent as soon as m_sendto (or the worker itself, when an ACK slides the window) rings the doorbell,
+// window updates as soon as m_recvfrom reopens a closed receive window.
+// Every message in flight has a retransmission timer in the timer wheel of the worker, only the messages whose timer
+// expired are retransmitted.
+void send_ready(worker *wk)
+{
+    // only the sockets whose doorbell was rung have new work, the rest are left to their timers
+    int count = m_table_ready(ctrl, wk->id, wk->ready);
+    for (int k = 0; k < count; k++)
+    {
+        int i = wk->ready[k];
+        lock_socket(i);
+        if (SM[i].is_free == 0)
+        {
+            // m_recvfrom reopened a closed receive window, tell the peer without waiting for the periodic update
+            if (SM[i].window_update)
+            {
+                send_window_update(&wk->tx, i);
+            }
+
+            // send the messages of the window that were never sent and start their timers
+            uint32_t end = SM[i].swnd.base + send_window(i);
+            if (SEQ_GT(end, SM[i].num_messages_sent + 1))
+                end = SM[i].num_messages_sent + 1;
+            while (SEQ_LT(SM[i].swnd.next, end))
+            {
+                uint32_t seq = SM[i].swnd.next;
+                int j = SEND_SLOT(seq);
+                if (transmit(&wk->tx, i, seq) < 0)
+                    break;
+                wheel_arm(&wk->tw, i, seq, SM[i].send_time[j] / 1000 + SM[i].rto);
+                SM[i].swnd.next++;
+
+                mtp_counters *c = &SM[i].counters;
+                long long delay = SM[i].send_time[j] - SM[i].send_queued_at[j];
+                c->msgs_sent++;
+                c->bytes_sent += SM[i].send_len[j];
+                c->send_delay += delay;
+                if (delay > c->send_delay_max)
+                    c->send_delay_max = delay;
+                TRACE(TRACE_DATA, TR_SEND, i, seq, SM[i].send_len[j], (int)(SM[i].swnd.next - SM[i].swnd.base));
+            }
+
+            // the retransmission timers do not resend into a closed window, the persist timer probes it
+            if (!window_stalled(i))
+            {
+                SM[i].persist = 0;
+            }
+            else if (SM[i].persist == 0)
+            {
+                SM[i].persist = SM[i].rto;
+                persist_arm(&wk->tw, i, now_ms());
+            }
+        }
+        tx_flush(&wk->tx);
+        unlock_socket(i);
+    }
+}
+
+/*
+Process the datagram of n bytes received on MTP socket i, with its header at header and its payload at payload:
+data is stored and acknowledged, ACKs free the send buffer
+    a payload that already sits in the receive buffer entry of its message is not copied (see rx_target)
+    replies are queued in the batch of worker wk, the caller holds the lock of MTP socket i and flushes the batch
+*/
+void handle_datagram(worker *wk, int i, char *header, char *payload, int n)
+{
+    {
+        if (dropMessage(drop_prob))
+        {
+            // drop the message
+            SM[i].counters.drops++;
+            TRACE(TRACE_LOSS, TR_DROP, i, -1, TR_DROP_EMULATED, n);
+            return;
+        }
+        if (n > 1 && !(header[1] & MTP_FLAG_ACK) && !bottleneck_admit(n))
+        {
+            SM[i].counters.drops++;
+            TRACE(TRACE_LOSS, TR_DROP, i, -1, TR_DROP_BOTTLENECK, n);
+            return;
+        }
+    }
+
+    if (n < MESSAGE_HEADER_SIZE || header[0] != MTP_VERSION)
+    {
+        SM[i].counters.drops++;
+        TRACE(TRACE_LOSS, TR_DROP, i, -1, TR_DROP_HEADER, n);
+        return;
+    }
+    mtp_header h;
+    process_header(header, &h);
+    // the payload length must match the datagram, a data message carries at least one byte
+    // and the payload of an ACK is a SACK bitmap
+    if (h.len != n - MESSAGE_HEADER_SIZE || (!(h.flags & MTP_FLAG_ACK) && h.len == 0) || (h.flags & MTP_FLAG_ACK && h.len > SACK_BITMAP_SIZE))
+    {
+        SM[i].counters.drops++;
+        TRACE(TRACE_LOSS, TR_DROP, i, -1, TR_DROP_LENGTH, n);
+        return;
+    }
+    // if it is a data message
+    int is_ack = h.flags & MTP_FLAG_ACK;
+    uint32_t seq_num = is_ack ? h.ack : h.seq;
+    int win_len = h.window;
+
+    if (is_ack)
+    {
+        // the cumulative ACK and the SACK bitmap free the entries of the messages received,
+        // the window base then moves over the freed entries; an ACK that frees nothing is a duplicate
+        int acked = 0;
+        uint32_t base = SM[i].swnd.base;
+        uint32_t end = SEQ_LT(seq_num + 1, SM[i].swnd.next) ? seq_num + 1 : SM[i].swnd.next;
+        uint32_t high = end;     // one past the last message acknowledged, by the cumulative ACK or the bitmap
+        // latest transmission of the messages this ACK frees, of those sent once only: for a message sent again
+        // the ACK may be for its first copy (Karn's rule), which would make everything sent after it look lost
+        long long acked_time = 0;
+
+        // Karn's rule: only messages transmitted once give an unambiguous RTT sample
+        uint32_t echo = h.seq;
+        long long rtt = -1;
+        if (SEQ_GEQ(echo, SM[i].swnd.base) && SEQ_LT(echo, SM[i].swnd.next) && SM[i].send_len[SEND_SLOT(echo)] != 0 && SM[i].send_tx_count[SEND_SLOT(echo)] == 1)
+        {
+            rtt = now_us() - SM[i].send_time[SEND_SLOT(echo)];
+        }
+
+        for (uint32_t s = SM[i].swnd.base; SEQ_LT(s, end); s++)
+        {
+            int j = SEND_SLOT(s);
+            if (SM[i].send_len[j] != 0)
+            {
+                SM[i].send_len[j] = 0;
+                acked++;
+                if (SM[i].send_tx_count[j] == 1 && SM[i].send_time[j] > acked_time)
+                    acked_time = SM[i].send_time[j];
+            }
+        }
+        for (int k = 0; k < h.len * 8; k++)
+        {
+            uint32_t s = seq_num + 2 + k;
+            int j = SEND_SLOT(s);
+            if (payload[k / 8] & (1 << (k % 8)) && SEQ_GEQ(s, SM[i].swnd.base) && SEQ_LT(s, SM[i].swnd.next))
+            {
+                high = s + 1;
+                if (SM[i].send_len[j] != 0)
+                {
+                    SM[i].send_len[j] = 0;
+                    acked++;
+                    if (SM[i].send_tx_count[j] == 1 && SM[i].send_time[j] > acked_time)
+                        acked_time = SM[i].send_time[j];
+                }
+            }
+        }
+        while (SEQ_LT(SM[i].swnd.base, SM[i].swnd.next) && SM[i].send_len[SEND_SLOT(SM[i].swnd.base)] == 0)
+        {
+            SM[i].swnd.base++;
+        }
+        if (rtt >= 0 && SM[i].send_len[SEND_SLOT(echo)] == 0)
+        {
+            rtt_sample(i, rtt);
+        }
+        else
+        {
+            rtt = -1;
+        }
+        // the base moved past the message that timed out: the recovery is over, drop the backoff
+        if (SM[i].rto_backoff && SEQ_GT(SM[i].swnd.base, SM[i].rto_backoff_base))
+        {
+            SM[i].rto = rto_estimate(i);
+            SM[i].rto_backoff = 0;
+        }
+        int is_duplicate = acked == 0;
+        SM[i].counters.acks_received++;
+        TRACE(TRACE_ACK, TR_RECV_ACK, i, seq_num, acked, win_len);
+        if (is_duplicate && echo != 0)
+            SM[i].counters.dup_acks++;
+        if (acked > 0)
+        {
+            mtp_cc_algos[SM[i].cc.algo]->on_ack(&SM[i].cc, acked, rtt, SM[i].srtt, now_us());
+        }
+
+        // fast retransmit and NewReno recovery (RFC 6582): dup_ack_threshold ACKs that do not move the
+        // window base while messages are in flight mean that the message at the base was lost, resend it
+        // without waiting for its timer and reduce cwnd once for every message sent so far (up to recover);
+        // until they are all acknowledged, every ACK that moves the base (partial ACK) resends the new base,
+        // the next hole (window updates, which echo no message, are not duplicate ACKs)
+        if (SM[i].in_recovery && SEQ_GT(SM[i].swnd.base, SM[i].recover))
+        {
+            SM[i].in_recovery = 0;
+        }
+        if (acked > 0 && dup_ack_threshold > 0)
+        {
+            sack_recovery(&wk->tx, i, high, acked_time);
+        }
+        if (SM[i].swnd.base != base)
+        {
+            SM[i].dup_acks = 0;
+            // a base sent after the messages just acknowledged is in flight still (sack_recovery may have resent it)
+            if (SM[i].in_recovery && SEQ_LT(SM[i].swnd.base, SM[i].swnd.next) && SM[i].send_time[SEND_SLOT(SM[i].swnd.base)] < acked_time)
+                fast_retransmit(&wk->tx, i, SM[i].swnd.base);
+        }
+        else if (echo != 0 && SEQ_LT(SM[i].swnd.base, SM[i].swnd.next))
+        {
+            SM[i].dup_acks++;
+            TRACE(TRACE_LOSS, TR_DUP_ACK, i, seq_num, SM[i].dup_acks, 0);
+            if (SM[i].dup_acks == dup_ack_threshold && !SM[i].in_recovery && fast_retransmit(&wk->tx, i, SM[i].swnd.base) == 0)
+            {
+                SM[i].in_recovery = 1;
+                SM[i].recover = SM[i].swnd.next - 1;
+                mtp_cc_algos[SM[i].cc.algo]->on_loss(&SM[i].cc, now_us());
+            }
+        }
+
+        SM[i].swnd.size = win_len > MAX_WINDOW_SIZE ? MAX_WINDOW_SIZE : win_len;
+
+        if (!is_duplicate)
+        {
+            // a send buffer entry was freed, wake up blocked m_sendto calls
+            SM[i].send_event++;
+            if (SM[i].send_waiters > 0)
+                m_futex_wake(&SM[i].send_event);
+        }
+
+        // the window may have moved, send the messages that entered it before sleeping again
+        m_mark_ready(ctrl, i);
+    }
+    else
+    {
+        // messages before rwnd.base were delivered already, their ACK was lost: acknowledge them again
+        // messages past the receive buffer are dropped and answered with a window update (echoing no message, so
+        // that it is no duplicate ACK), which reopens the window of a sender probing it (see persist_fire)
+        // every ACK is cumulative with a SACK bitmap, so a lost ACK is covered by the next one
+        if (SEQ_GEQ(seq_num, SM[i].rwnd.base + MAX_RECEIVE_BUFFER_SIZE))
+        {
+            SM[i].counters.out_of_window++;
+            TRACE(TRACE_LOSS, TR_OUT_OF_WINDOW, i, seq_num, SM[i].rwnd.base, 0);
+            send_ack(&wk->tx, i, 0);
+            return;
+        }
+        int j = RECEIVE_SLOT(seq_num);
+        if (SEQ_GEQ(seq_num, SM[i].rwnd.base) && SM[i].receive_len[j] == 0)
+        {
+            if (payload != SM[i].receive_buffer[j])
+                memcpy(SM[i].receive_buffer[j], payload, h.len);
+            SM[i].receive_len[j] = h.len;
+            SM[i].receive_time[j] = now_us();
+            SM[i].counters.msgs_received++;
+            SM[i].counters.bytes_received += h.len;
+            SM[i].rwnd.size--;
+            TRACE(TRACE_DATA, TR_RECV_DATA, i, seq_num, h.len, SM[i].rwnd.size);
+            while (SEQ_LT(SM[i].rwnd.next, SM[i].rwnd.base + MAX_RECEIVE_BUFFER_SIZE) && SM[i].receive_len[RECEIVE_SLOT(SM[i].rwnd.next)] != 0)
+            {
+                SM[i].rwnd.next++;
+            }
+
+            // the next message in order arrived, wake up blocked m_recvfrom calls
+            if (seq_num == SM[i].rwnd.base)
+            {
+                SM[i].receive_event++;
+                if (SM[i].receive_waiters > 0)
+                    m_futex_wake(&SM[i].receive_event);
+            }
+        }
+        else
+        {
+            SM[i].counters.duplicates++;
+            TRACE(TRACE_LOSS, TR_DUPLICATE, i, seq_num, 0, 0);
+        }
+        send_ack(&wk->tx, i, seq_num);
+    }
+}
+
+// Read every datagram queued on MTP socket i of worker wk, the socket is edge triggered
+void receive_ready(worker *wk, int i)
+{
+    while (1)
+    {
+        lock_socket(i);
+        // the socket may have been closed since epoll_wait returned
+        if (SM[i].is_free == 1)
+        {
+            unlock_socket(i);
+            break;
+        }
+        // a batch of datagrams is read with one recvmmsg, and their ACKs go out with one sendmmsg
+        rx_target(&wk->rx, i);
+        int n = recvmmsg(SM[i].udp_sock, wk->rx.msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+        if (n == -1)
+        {
+            // drained, the next datagram raises a new edge
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                pperror("[receiver] recvmmsg() failed");
+            unlock_socket(i);
+            break;
+        }
+        // move the payloads that may be overwritten before processing any of them
+        char *payload[IO_BATCH];
+        for (int m = 0; m < n; m++)
+        {
+            payload[m] = rx_payload(&wk->rx, i, m, wk->rx.msgs[m].msg_len);
+        }
+        for (int m = 0; m < n; m++)
+        {
+            handle_datagram(wk, i, wk->rx.header[m], payload[m], wk->rx.msgs[m].msg_len);
+        }
+        tx_flush(&wk->tx);
+        unlock_socket(i);
+
+        // a short batch emptied the socket
+        if (n < IO_BATCH)
+            break;
+    }
+}
+
+// Every T seconds, send a window update on each socket of the shard of worker wk
+void send_periodic_updates(worker *wk)
+{
+    /*
+        DUPLICATE ACK MESSAGE WITH THE LAST ACKNOWLEDGED SEQUENCE NUMBER BUT WITH THE UPDATED RWND SIZE
+    */
+    // for each socket update receiver window and size of the window and send the ack message
+    int *active = m_table_active(ctrl);
+    int count = __atomic_load_n(&ctrl->active_count, __ATOMIC_ACQUIRE);
+    for (int k = 0; k < count; k++)
+    {
+        int i = active[k];
+        if (i % num_workers != wk->id)
+            continue;
+        lock_socket(i);
+        if (SM[i].is_free == 0)
+        {
+            send_window_update(&wk->tx, i);
+        }
+        tx_flush(&wk->tx);
+        unlock_socket(i);
+    }
+}
+
+// pin worker wk to a CPU, the workers are spread over the online CPUs
+void pin_worker(worker *wk)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus > 0 ? wk->id % cpus : 0, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (err != 0)
+        printf(RED "[worker %d] pthread_setaffinity_np failed: %s\n" RESET, wk->id, strerror(err));
+}
+
+/*
+Worker Thread
+    it retransmits the messages whose timer expired, sends the new work of its ready sockets and sleeps in epoll_wait
+    until one of its UDP sockets is readable, an application rings its doorbell, a timer is due or the next
+    periodic window update is due
+*/
+void *W(void *arg)
+{
+    worker *wk = (worker *)arg;
+    char name[16];
+    snprintf(name, sizeof(name), "worker %d", wk->id);
+    mtp_trace_thread(wk->id, name);
+    if (pin_workers)
+        pin_worker(wk);
+    struct epoll_event events[R_MAX_EVENTS];
+    wk->next_update = now_ms() + T * 1000;
+    pthread_mutex_lock(&wk->run);
+    while (!__atomic_load_n(&wk->stop, __ATOMIC_ACQUIRE))
+    {
+        // retransmit the messages whose timer expired
+        wheel_advance(&wk->tw, &wk->tx, now_ms());
+
+        send_ready(wk);
+
+        long long now = now_ms();
+        if (now >= wk->next_update)
+        {
+            wk->next_update = now + T * 1000;
+            send_periodic_updates(wk);
+        }
+
+        // sleep until the next timer or periodic update, ringers only wake the worker up while sleeping is set,
+        // which is set before looking at the ready bitmap one last time
+        long long wait = wk->next_update - now;
+        long long next = wheel_next_expiry(&wk->tw);
+        if (next >= 0 && next - now < wait)
+            wait = next - now;
+        __atomic_store_n(&ctrl->worker[wk->id].sleeping, 1, __ATOMIC_SEQ_CST);
+        if (m_table_ready_pending(ctrl, wk->id))
+            wait = 0;
+        wk->wake_at = now + wait;
+        TRACE(TRACE_WAKE, TR_SLEEP, -1, 0, (int)wait, wk->tw.count);
+        pthread_mutex_unlock(&wk->run);
+        int nready = epoll_wait(wk->epoll_fd, events, R_MAX_EVENTS, wait > 0 ? (int)wait : 0);
+        pthread_mutex_lock(&wk->run);
+        TRACE(TRACE_WAKE, TR_WAKEUP, -1, 0, nready, 0);
+        __atomic_store_n(&ctrl->worker[wk->id].sleeping, 0, __ATOMIC_SEQ_CST);
+        if (nready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            pperror("[worker] epoll_wait() failed");
+            pthread_mutex_unlock(&wk->run);
+            pthread_exit(NULL);
+        }
+
+        for (int e = 0; e < nready; e++)
+        {
+            if (events[e].data.u32 == DOORBELL_TAG)
+            {
+                // the rings are in the ready bitmap, the datagrams only woke the worker up
+                char ring[64];
+                while (recv(wk->doorbell_fd, ring, sizeof(ring), MSG_DONTWAIT) > 0)
+                    ;
+            }
+            else if (events[e].data.u32 == TIMER_TAG)
+            {
+                // the timers are in the timer wheel, the expiration only woke the worker up
+                uint64_t expirations;
+                read(wk->timer_fd, &expirations, sizeof(expirations));
+            }
+            else
+            {
+                receive_ready(wk, events[e].data.u32);
+            }
+        }
+    }
+    pthread_mutex_unlock(&wk->run);
+    return NULL;
+}
+
+// create the epoll instance and the wakeup socket of worker w and start it, returns -1 on failure
+int worker_start(int w)
+{
+    worker *wk = &workers[w];
+    wk->id = w;
+    wk->shard = (max_sockets + num_workers - 1) / num_workers;
+    wk->doorbell_fd = -1;
+    wk->ready = malloc(wk->shard * sizeof(int));
+    wheel_init(&wk->tw, wk->shard, now_ms());
+    rx_init(&wk->rx);
+    wk->epoll_fd = epoll_create1(0);
+    wk->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wk->ready == NULL || wk->epoll_fd == -1 || wk->timer_fd == -1 || pthread_mutex_init(&wk->run, NULL) != 0)
+    {
+        int err = errno;
+        pperror("[main] worker setup failed");
+        errno = err;
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t len;
+    m_worker_addr(w, &addr, &len);
+    wk->doorbell_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (wk->doorbell_fd == -1 || bind(wk->doorbell_fd, (struct sockaddr *)&addr, len) == -1)
+    {
+        // EADDRINUSE: another initmsocket (or engine of this process) is running
+        int err = errno;
+        pperror("[main] wakeup socket of a worker failed");
+        errno = err;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = DOORBELL_TAG;
+    epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, wk->doorbell_fd, &ev);
+    ev.data.u32 = TIMER_TAG;
+    epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, wk->timer_fd, &ev);
+
+    if (pthread_create(&wk->thread, NULL, W, wk) != 0)
+    {
+        int err = errno;
+        pperror("pthread_create worker failed");
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// release what worker_start set up for worker w
+void worker_free(int w)
+{
+    worker *wk = &workers[w];
+    if (wk->epoll_fd != -1)
+        close(wk->epoll_fd);
+    if (wk->timer_fd != -1)
+        close(wk->timer_fd);
+    if (wk->doorbell_fd != -1)
+        close(wk->doorbell_fd);
+    free(wk->ready);
+    free(wk->tw.timers);
+}
+
+// stop and release the first n workers, which were started by worker_start: the expiry of its timer_fd wakes
+// every worker up, and it exits after the work it woke up for
+void workers_stop(int n)
+{
+    struct itimerspec its = {0};
+    its.it_value.tv_nsec = 1;
+    for (int w = 0; w < n; w++)
+    {
+        __atomic_store_n(&workers[w].stop, 1, __ATOMIC_RELEASE);
+        timerfd_settime(workers[w].timer_fd, 0, &its, NULL);
+        pthread_join(workers[w].thread, NULL);
+        worker_free(w);
+    }
+}
+
+/*
+Garbage Collector Thread
+    it checks whether the process corresponding to any of the MTP sockets is still alive or not
+    if the process is not alive, it cleans up the MTP socket
+*/
+void *G(void *arg)
+{
+    mtp_trace_thread(num_workers + 1, "G");
+    while (1)
+    {
+        sleep(GARBAGE_COLLECTOR_INTERVAL);
+        // a requester that died before reading its answer leaves its slot of the request ring taken:
+        // release it, with the UDP socket created for it
+        for (int k = 0; k < MTP_REQUEST_RING; k++)
+        {
+            mtp_request *r = &ctrl->request[k];
+            int pid = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+            if (pid == 0 || !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) || m_process_alive(pid, r->pid_start))
+                continue;
+            ppcyan("[garbage collector] ");
+            printf(CYAN "process %d died before reading its answer, releasing its request\n" RESET, pid);
+            if (r->op == MTP_OP_SOCKET && r->sock_id > 0)
+                close(r->sock_id);
+            m_request_release(r);
+        }
+
+        // walk the entries in use from the end, a release moves the last entry (already checked) into its place
+        int *active = m_table_active(ctrl);
+        for (int k = ctrl->active_count - 1; k >= 0; k--)
+        {
+            m_mutex_lock(&ctrl->table_lock);
+            if (k >= ctrl->active_count)
+            {
+                // entries were released meanwhile
+                m_mutex_unlock(&ctrl->table_lock);
+                continue;
+            }
+            int i = active[k];
+            lock_socket(i);
+            if (SM[i].is_free == 0 && SM[i].pid != 0)
+            {
+                if (!m_process_alive(SM[i].pid, SM[i].pid_start))
+                {
+                    ppcyan("[garbage collector] ");
+                    printf(CYAN "process %d has been killed, cleaning up MTP socket %d\n" RESET, SM[i].pid, i);
+                    TRACE(TRACE_REQ, TR_COLLECT, i, 0, SM[i].pid, 0);
+                    SM[i].is_free = 1;
+                    SM[i].pid = 0;
+                    SM[i].pid_start = 0;
+                    epoll_ctl(workers[i % num_workers].epoll_fd, EPOLL_CTL_DEL, SM[i].udp_sock, NULL);
+                    close(SM[i].udp_sock);
+                    SM[i].udp_sock = 0;
+                    memset(SM[i].source_ip, 0, 16);
+                    SM[i].source_port = 0;
+                    memset(SM[i].dest_ip, 0, 16);
+                    SM[i].dest_port = 0;
+                    memset(SM[i].send_len, 0, sizeof(SM[i].send_len));
+                    memset(SM[i].receive_len, 0, sizeof(SM[i].receive_len));
+                    memset(&SM[i].swnd, 0, sizeof(swnd));
+                    memset(&SM[i].rwnd, 0, sizeof(rwnd));
+                    SM[i].send_waiters = 0;
+                    SM[i].receive_waiters = 0;
+                    SM[i].dup_acks = 0;
+                    memset(&SM[i].counters, 0, sizeof(mtp_counters));
+                    SM[i].srtt = 0;
+                    SM[i].rttvar = 0;
+                    SM[i].rto_backoff = 0;
+                    SM[i].in_recovery = 0;
+                    SM[i].persist = 0;
+                    unlock_socket(i);
+                    m_table_release(ctrl, i);
+                    m_mutex_unlock(&ctrl->table_lock);
+                    continue;
+                }
+            }
+            unlock_socket(i);
+            m_mutex_unlock(&ctrl->table_lock);
+        }
+    }
+}
+
+// ------------------------------------------ Requests ------------------------------------------
+// Carry out request r of the request ring and write the answer in it
+void handle_request(mtp_request *r)
+{
+    if (r->op == MTP_OP_CLOSE)
+    {
+        if (engine_debug)
+            ppblue("[main] Close requested\n");
+        epoll_ctl(workers[r->mtp_id % num_workers].epoll_fd, EPOLL_CTL_DEL, r->sock_id, NULL);
+        close(r->sock_id);
+    }
+    else if (r->op == MTP_OP_SOCKET)
+    {
+        if (engine_debug)
+            ppblue("[main] Sock requested\n");
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd == -1)
+        {
+            pperror("[main] socket failed");
+            r->sock_id = -1;
+            r->err_no = errno;
+        }
+        else
+        {
+            r->sock_id = sockfd;
+        }
+    }
+    else if (r->op == MTP_OP_BIND)
+    {
+        if (engine_debug)
+            ppblue("[main] Bind requested\n");
+        struct sockaddr_in servaddr;
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_addr.s_addr = inet_addr(r->IP);
+        servaddr.sin_port = htons(r->port);
+        socklen_t len = sizeof(servaddr);
+        int b = bind(r->sock_id, (const struct sockaddr *)&servaddr, len);
+        if (b == -1)
+        {
+            pperror("[main] bind failed");
+            r->sock_id = -1;
+            r->err_no = errno;
+        }
+        else
+        {
+            // its worker learns about the socket right away, edge triggered so that it reads it until it would block
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u32 = r->mtp_id;
+            int epoll_fd = workers[r->mtp_id % num_workers].epoll_fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, r->sock_id, &ev) == -1 && (errno != EEXIST || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, r->sock_id, &ev) == -1))
+            {
+                pperror("[main] epoll_ctl failed");
+                r->sock_id = -1;
+                r->err_no = errno;
+            }
+        }
+    }
+    else
+    {
+        r->sock_id = -1;
+        r->err_no = EINVAL;
+    }
+    TRACE(TRACE_REQ, TR_REQUEST, r->op == MTP_OP_SOCKET ? -1 : r->mtp_id, 0, r->op, r->sock_id);
+}
+
+// ------------------------------------------ Engine ------------------------------------------
+void mtp_engine_bottleneck(double rate_kBps, double burst_kB)
+{
+    bottleneck_rate = rate_kBps * 1000 / 1e6;
+    bottleneck_burst = bottleneck_tokens = burst_kB * 1000;
+    bottleneck_time = now_us();
+}
+
+// set up the table sm of sockets entries and its control block c for threads workers
+int table_init(mtp_socket *sm, mtp_control *c, int sockets, int threads)
+{
+    // only is_free and the lock of every entry are touched, so that the pages of the buffers are not allocated
+    // until a socket uses them
+    for (int i = 0; i < sockets; i++)
+    {
+        sm[i].is_free = 1;
+        // one lock per MTP socket entry
+        if (m_mutex_init(&sm[i].lock) < 0)
+        {
+            pperror("MTP socket lock failed");
+            return -1;
+        }
+    }
+    m_table_init(c, sockets, threads);
+    return 0;
+}
+
+int mtp_engine_table_init()
+{
+    return table_init(SM, ctrl, max_sockets, num_workers);
+}
+
+int mtp_engine_start(int collect)
+{
+    workers = calloc(num_workers, sizeof(worker));
+    if (workers == NULL)
+    {
+        pperror("calloc workers failed");
+        return -1;
+    }
+    // on failure the workers started so far are stopped, so the caller can free the table
+    for (int w = 0; w < num_workers; w++)
+    {
+        if (worker_start(w) < 0)
+        {
+            int err = errno;
+            worker_free(w);
+            workers_stop(w);
+            free(workers);
+            workers = NULL;
+            errno = err;
+            return -1;
+        }
+    }
+    // create thread for G (Garbage collector)
+    if (collect && pthread_create(&G_thread, NULL, G, NULL) != 0)
+    {
+        pperror("pthread_create G failed");
+        int err = errno;
+        workers_stop(num_workers);
+        free(workers);
+        workers = NULL;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Embedded engine: the application thread that has new work for MTP socket i does it in place of the worker of i
+when the worker is idle, so that a message goes out without a wakeup of the worker and a switch to it
+    the retransmission timers it arms may be due before the sleeping worker planned to wake up, its timer_fd is
+    then set to the earliest one
+    returns 0 if the worker is busy, the caller rings its doorbell instead
+*/
+int engine_kick(int i)
+{
+    worker *wk = &workers[i % num_workers];
+    // with messages in flight the ACKs bring the worker round anyway, and it sends the new messages in batches
+    if (__atomic_load_n(&SM[i].swnd.next, __ATOMIC_RELAXED) != __atomic_load_n(&SM[i].swnd.base, __ATOMIC_RELAXED))
+        return 0;
+    if (pthread_mutex_trylock(&wk->run) != 0)
+        return 0;
+    m_mark_ready(ctrl, i);
+    send_ready(wk);
+    long long next = wheel_next_expiry(&wk->tw);
+    if (next >= 0 && next < wk->wake_at)
+    {
+        struct itimerspec its = {0};
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = next % 1000 * 1000000;
+        timerfd_settime(wk->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        wk->wake_at = next;
+    }
+    pthread_mutex_unlock(&wk->run);
+    return 1;
+}
+
+/*
+Embedded engine
+    the table and the control block are private, zero filled memory of the process instead of the segments of
+    initmsocket, the UDP sockets are in the descriptor table of the process and the requests are carried out by the
+    thread that makes them (m_request calls handle_request), so that no message or request leaves the process
+    there is no G: every socket belongs to the process itself
+*/
+int m_embed(int sockets, int threads)
+{
+    if (sockets < 1 || threads < 1 || threads > MTP_MAX_WORKERS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // the process must not use initmsocket or an engine, and keeps the claim until the engine runs, so the globals
+    // of the engine are only set once nothing else can be using them
+    if (m_engine_claim() < 0)
+        return -1;
+    if (SM != NULL)
+    {
+        // initmsocket itself
+        m_engine_release(0);
+        errno = EISCONN;
+        return -1;
+    }
+
+    size_t sm_size = sizeof(mtp_socket) * sockets, ctrl_size = m_control_size(sockets, threads);
+    mtp_socket *sm = mmap(NULL, sm_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mtp_control *c = mmap(NULL, ctrl_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // the wakeup sockets of the workers are named after the process (see m_worker_addr), so it is attached first
+    int ok = sm != MAP_FAILED && c != MAP_FAILED && table_init(sm, c, sockets, threads) == 0 &&
+             m_attach_engine(sm, c, handle_request, engine_kick) == 0;
+    if (ok)
+    {
+        int old_sockets = max_sockets, old_workers = num_workers, old_debug = engine_debug;
+        SM = sm;
+        ctrl = c;
+        max_sockets = sockets;
+        num_workers = threads;
+        engine_debug = 0;
+        ok = mtp_engine_start(0) == 0;
+        if (!ok)
+        {
+            SM = NULL;
+            ctrl = NULL;
+            max_sockets = old_sockets;
+            num_workers = old_workers;
+            engine_debug = old_debug;
+        }
+    }
+    int err = errno;
+    m_engine_release(ok);
+    if (!ok)
+    {
+        if (sm != MAP_FAILED)
+            munmap(sm, sm_size);
+        if (c != MAP_FAILED)
+            munmap(c, ctrl_size);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
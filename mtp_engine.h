@@ -0,0 +1,43 @@
+/**
+ * @file mtp_engine.h
+ *
+ * @brief Protocol engine of the MTP sockets: the worker threads that send, receive, acknowledge and retransmit the
+ * messages of an MTP socket table, and carry out the requests of the applications (mtp_request).
+ * initmsocket runs it on the shared segments for every application of the host; an application can run its own
+ * on private memory with m_embed(), without initmsocket.
+ * The documentation for the functions can be found in documentation.txt
+*/
+#ifndef _MTP_ENGINE_H
+#define _MTP_ENGINE_H
+
+#include <msocket.h>
+
+// Table and control block the engine works on, set before mtp_engine_table_init
+extern mtp_socket *SM;
+extern mtp_control *ctrl;
+
+// Settings of the engine, set before mtp_engine_table_init (initmsocket sets them from its options)
+extern int max_sockets;       // size of the MTP socket table
+extern int num_workers;       // worker threads, worker w owns the MTP sockets i with i % num_workers == w
+extern int pin_workers;       // pin worker w to CPU w
+extern int rto_min;           // bounds of the retransmission timeout in ms
+extern int rto_max;
+extern float drop_prob;       // probability of dropping a received datagram
+extern int dup_ack_threshold; // duplicate ACKs that trigger a fast retransmission, 0 disables it
+extern int engine_debug;      // print the requests on stdout, the datagrams go to the binary trace (mtp_trace.h)
+
+// Function to emulate a bottleneck shared by every MTP socket of the engine (rate 0 for none)
+void mtp_engine_bottleneck(double rate_kBps, double burst_kB);
+
+// Function to mark every entry of the table free and set up the allocator and the request ring
+// SM and ctrl must be zero filled; returns 0 on success, -1 on failure
+int mtp_engine_table_init();
+
+// Function to start the worker threads, and G (the garbage collector of the sockets of dead processes) if collect is set
+// Returns 0 on success, -1 on failure
+int mtp_engine_start(int collect);
+
+// Function to carry out request r and write the answer in it
+void handle_request(mtp_request *r);
+
+#endif
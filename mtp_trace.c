@@ -0,0 +1,138 @@
+/**
+ * @file mtp_trace.c
+ *
+ * @brief Binary trace of the protocol engine: the trace file, the per-thread rings and the names of the events.
+ * The documentation for the functions can be found in documentation.txt
+*/
+#include <msocket.h>
+#include <mtp_trace.h>
+#include <sys/mman.h>
+
+unsigned int mtp_trace_mask = 0;
+
+mtp_trace_header *trace_file = NULL;
+size_t trace_ring_size = 0; // bytes of a ring with its records
+
+// ring of the calling thread, NULL if it records nothing, and its index
+__thread mtp_trace_ring *trace_ring = NULL;
+__thread int trace_ring_id = 0;
+
+// names and classes of the events, indexed by TR_*
+const char *trace_names[TR_EVENTS] = {
+    "send", "retransmit", "fast_retransmit", "timeout", "recv_data", "duplicate", "out_of_window", "ack_sent",
+    "window_update", "recv_ack", "dup_ack", "rtt", "drop", "sleep", "wakeup", "request", "collect", "window_probe"};
+const unsigned int trace_classes[TR_EVENTS] = {
+    TRACE_DATA, TRACE_LOSS, TRACE_LOSS, TRACE_LOSS, TRACE_DATA, TRACE_LOSS, TRACE_LOSS, TRACE_ACK,
+    TRACE_ACK, TRACE_ACK, TRACE_LOSS, TRACE_ACK, TRACE_LOSS, TRACE_WAKE, TRACE_WAKE, TRACE_REQ, TRACE_REQ, TRACE_LOSS};
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int mtp_trace_open(const char *path, int rings, unsigned int mask)
+{
+    trace_ring_size = sizeof(mtp_trace_ring) + sizeof(mtp_trace_record) * MTP_TRACE_RECORDS;
+    size_t size = sizeof(mtp_trace_header) + trace_ring_size * rings;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    // the file is sparse, the pages of a ring are only allocated as it fills up
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    trace_file = map;
+    memcpy(trace_file->magic, MTP_TRACE_MAGIC, sizeof(trace_file->magic));
+    trace_file->version = MTP_TRACE_VERSION;
+    trace_file->rings = rings;
+    trace_file->ring_records = MTP_TRACE_RECORDS;
+    trace_file->mask = mask;
+    trace_file->start = trace_now();
+    mtp_trace_mask = mask;
+    return 0;
+}
+
+void mtp_trace_thread(int ring, const char *name)
+{
+    if (trace_file == NULL || ring < 0 || ring >= (int)trace_file->rings)
+    {
+        trace_ring = NULL;
+        return;
+    }
+    trace_ring = (mtp_trace_ring *)((char *)trace_file + sizeof(mtp_trace_header) + trace_ring_size * ring);
+    trace_ring_id = ring;
+    strncpy(trace_ring->name, name, sizeof(trace_ring->name) - 1);
+}
+
+void mtp_trace_poll()
+{
+    if (trace_file != NULL)
+        __atomic_store_n(&mtp_trace_mask, __atomic_load_n(&trace_file->mask, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+void mtp_trace_emit(int event, int sock, uint32_t seq, int a, int b)
+{
+    mtp_trace_ring *r = trace_ring;
+    if (r == NULL)
+        return;
+    // only this thread writes to its ring, the head is published after the record for a reader of the live file
+    uint64_t head = r->head;
+    mtp_trace_record *rec = &r->records[head & (MTP_TRACE_RECORDS - 1)];
+    rec->time = trace_now();
+    rec->event = event;
+    rec->ring = trace_ring_id;
+    rec->sock = sock;
+    rec->seq = seq;
+    rec->a = a;
+    rec->b = b;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+long mtp_trace_parse_mask(const char *s)
+{
+    char *end;
+    long mask = strtol(s, &end, 0);
+    if (*s != '\0' && *end == '\0')
+        return mask >= 0 && mask <= TRACE_ALL ? mask : -1;
+
+    static const char *names[] = {"data", "ack", "loss", "wake", "req"};
+    char copy[64];
+    strncpy(copy, s, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    mask = 0;
+    for (char *save, *name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        int found = strcmp(name, "all") == 0;
+        if (found)
+            mask = TRACE_ALL;
+        for (int k = 0; k < 5 && !found; k++)
+        {
+            if (strcmp(name, names[k]) == 0)
+            {
+                mask |= 1 << k;
+                found = 1;
+            }
+        }
+        if (!found)
+            return -1;
+    }
+    return mask;
+}
+
+const char *mtp_trace_event_name(int event)
+{
+    return event >= 0 && event < TR_EVENTS ? trace_names[event] : NULL;
+}
+
+unsigned int mtp_trace_event_class(int event)
+{
+    return event >= 0 && event < TR_EVENTS ? trace_classes[event] : 0;
+}
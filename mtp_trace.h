@@ -0,0 +1,126 @@
+/**
+ * @file mtp_trace.h
+ *
+ * @brief Binary trace of the protocol engine.
+ * Every thread of the engine (the workers, main and G) writes fixed-size, timestamped records into its own ring,
+ * so no lock is taken and nothing is formatted on the hot path; the rings live in a file mapped by initmsocket -t,
+ * which keeps the last records of every thread after the daemon exits and is decoded offline by mtptrace.
+ * Which events are recorded is set by a mask of event classes that can be changed while the daemon runs;
+ * a disabled class costs one load and one branch (TRACE).
+ * The documentation for the functions can be found in documentation.txt
+*/
+#ifndef _MTP_TRACE_H
+#define _MTP_TRACE_H
+
+#include <stdint.h>
+
+// Event classes, the bits of the mask
+#define TRACE_DATA 0x01 // data messages sent and received
+#define TRACE_ACK 0x02  // ACKs and window updates sent and received, RTT samples
+#define TRACE_LOSS 0x04 // drops, duplicates, duplicate ACKs, timeouts and retransmissions
+#define TRACE_WAKE 0x08 // sleeps and wakeups of the workers
+#define TRACE_REQ 0x10  // requests of the applications and sockets collected by G
+#define TRACE_ALL 0x1f
+
+// Events: what sock, seq, a and b of the record hold
+#define TR_SEND 0             // first transmission of message seq: a = length, b = messages in flight
+#define TR_RETRANSMIT 1       // retransmission of message seq on a timeout: a = transmissions, b = rto in ms
+#define TR_FAST_RETRANSMIT 2  // retransmission of message seq on duplicate ACKs: a = duplicate ACKs, b = cwnd
+#define TR_TIMEOUT 3          // timeout of the oldest message seq: a = new rto in ms, b = cwnd
+#define TR_RECV_DATA 4        // message seq stored: a = length, b = free receive entries left
+#define TR_DUPLICATE 5        // message seq received again and acknowledged again
+#define TR_OUT_OF_WINDOW 6    // message seq past the receive buffer dropped and acknowledged: a = rwnd.base
+#define TR_ACK_SENT 7         // ACK of seq (cumulative): a = window, b = data message that triggered it
+#define TR_WINDOW_UPDATE 8    // window update, ACK of seq: a = window
+#define TR_RECV_ACK 9         // ACK of seq received: a = messages it acknowledged, b = window of the peer
+#define TR_DUP_ACK 10         // duplicate ACK of seq: a = duplicate ACKs in a row
+#define TR_RTT 11             // RTT sample of message seq: a = sample in us, b = srtt in us
+#define TR_DROP 12            // datagram dropped: a = reason (TR_DROP_*), b = length
+#define TR_SLEEP 13           // the worker sleeps: a = timeout in ms, b = armed timers
+#define TR_WAKEUP 14          // the worker wakes up: a = events
+#define TR_REQUEST 15         // request of an application for MTP socket sock: a = op, b = UDP socket (-1 on failure)
+#define TR_COLLECT 16         // MTP socket sock of a dead process released by G: a = pid
+#define TR_WINDOW_PROBE 17    // message seq sent by the persist timer into a closed window: a = next interval in ms
+#define TR_EVENTS 18
+
+#define TR_DROP_EMULATED 0   // initmsocket -p
+#define TR_DROP_BOTTLENECK 1 // initmsocket -r
+#define TR_DROP_HEADER 2
+#define TR_DROP_LENGTH 3
+
+#define MTP_TRACE_MAGIC "MTPTRACE"
+#define MTP_TRACE_VERSION 1
+#define MTP_TRACE_RECORDS 65536 // records per ring, a power of 2
+
+// Structure for a record, 32 bytes
+typedef struct mtp_trace_record
+{
+    uint64_t time;  // CLOCK_MONOTONIC ns
+    uint16_t event; // TR_*
+    uint16_t ring;  // thread that wrote it
+    int32_t sock;   // MTP socket, -1 if none
+    uint32_t seq;
+    int32_t a;
+    int32_t b;
+    int32_t pad;
+} mtp_trace_record;
+
+// Structure for the header of a ring: the ring holds the last ring_records of the head records written by its thread
+typedef struct mtp_trace_ring
+{
+    uint64_t head;
+    char name[16]; // "worker 0", "main", "G"
+    char pad[40];
+    mtp_trace_record records[];
+} mtp_trace_ring;
+
+// Structure for the header of a trace file, followed by the rings
+typedef struct mtp_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t rings;
+    uint32_t ring_records;
+    uint32_t mask;  // event classes recorded, mtptrace -S changes it while the daemon runs (see mtp_trace_poll)
+    uint64_t start; // CLOCK_MONOTONIC ns when the file was created
+    char pad[32];
+} mtp_trace_header;
+
+_Static_assert(sizeof(mtp_trace_record) == 32, "mtp_trace_record must not be padded");
+_Static_assert(sizeof(mtp_trace_ring) == 64 && sizeof(mtp_trace_header) == 64, "trace headers are one cache line");
+
+// Classes recorded by the process, 0 unless a trace file is open
+extern unsigned int mtp_trace_mask;
+
+// Record an event of class cls if the class is enabled
+#define TRACE(cls, event, sock, seq, a, b)                                  \
+    do                                                                      \
+    {                                                                       \
+        if (__builtin_expect(mtp_trace_mask & (cls), 0))                    \
+            mtp_trace_emit((event), (sock), (seq), (a), (b));               \
+    } while (0)
+
+// Function to create the trace file at path with rings rings and start recording the classes of mask
+// Returns 0 on success, -1 on failure
+int mtp_trace_open(const char *path, int rings, unsigned int mask);
+
+// Function to have the calling thread write to ring ring under name (nothing is recorded without a trace file)
+void mtp_trace_thread(int ring, const char *name);
+
+// Function to pick up the mask written into the trace file by mtptrace -S
+void mtp_trace_poll();
+
+// Function to write a record to the ring of the calling thread, see TRACE
+void mtp_trace_emit(int event, int sock, uint32_t seq, int a, int b);
+
+// Function to parse a mask: a number or a comma separated list of data, ack, loss, wake, req and all
+// Returns the mask, -1 if it is not valid
+long mtp_trace_parse_mask(const char *s);
+
+// Function to get the name of an event, NULL for an unknown event
+const char *mtp_trace_event_name(int event);
+
+// Function to get the class of an event, 0 for an unknown event
+unsigned int mtp_trace_event_class(int event);
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * @file mtpstat.c
+ *
+ * @brief Prints the MTP sockets in use with their protocol statistics, like ss -i for TCP.
+ * initmsocket must be running in the same directory; the sockets of an engine embedded in a process (m_embed) are
+ * private to it and are not shown. The sockets are sampled with m_getstats_all, which takes no lock of the daemon or
+ * of the sockets, so sampling does not slow the traffic down.
+ *
+ * With -i interval_ms the sockets are sampled every interval_ms ms (count times with -c) and every sample after the
+ * first one also shows the rates and the mean queueing delays over the interval.
+ *
+ * Usage: ./mtpstat [-i interval_ms] [-c count] [-p pid]
+ */
+#include <msocket.h>
+#include <getopt.h>
+#include <time.h>
+
+int interval_ms = 0;
+int count = -1;
+int only_pid = 0;
+
+void parse_args(int argc, char *argv[]);
+
+// ---------------- Helper Functions ---------------- //
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// mean of total over n in ms, 0 if n is 0
+double mean_ms(long long total, long long n)
+{
+    return n > 0 ? (double)total / n / 1000 : 0;
+}
+
+int by_sockfd(const void *a, const void *b)
+{
+    return ((const mtp_stats *)a)->sockfd - ((const mtp_stats *)b)->sockfd;
+}
+
+// sample of the same socket in prev, NULL if it was not in use then (or was reused by another process)
+mtp_stats *find_prev(mtp_stats *prev, int prev_count, const mtp_stats *st)
+{
+    for (int k = 0; k < prev_count; k++)
+    {
+        if (prev[k].sockfd == st->sockfd && prev[k].pid == st->pid && prev[k].counters.msgs_sent <= st->counters.msgs_sent)
+            return &prev[k];
+    }
+    return NULL;
+}
+
+// ---------------- Output ---------------- //
+void print_socket(const mtp_stats *st, const mtp_stats *prev, double elapsed)
+{
+    const mtp_counters *c = &st->counters;
+    char local[32], peer[32];
+    snprintf(local, sizeof(local), "%s:%d", st->source_ip, st->source_port);
+    snprintf(peer, sizeof(peer), "%s:%d", st->dest_ip, st->dest_port);
+    printf("%-6d %-8d %-22s %-22s %-7d %-7d %d\n", st->sockfd, st->pid, local, peer, st->send_queued, st->receive_queued, st->in_flight);
+
+    printf("\t %s cwnd:%.1f ssthresh:%.1f reductions:%d rtt:%.3f/%.3f min_rtt:%.3f rto:%d peer_wnd:%d rcv_wnd:%d\n",
+           mtp_cc_algos[st->cc_algo]->name, st->cwnd, st->ssthresh, st->cc_losses, st->srtt / 1000.0, st->rttvar / 1000.0,
+           c->min_rtt / 1000.0, st->rto, st->peer_window, st->receive_window);
+    printf("\t sent:%lld (%lld bytes) received:%lld (%lld bytes) delivered:%lld acks_sent:%lld acks_received:%lld\n",
+           c->msgs_sent, c->bytes_sent, c->msgs_received, c->bytes_received, c->msgs_delivered, c->acks_sent, c->acks_received);
+    printf("\t retrans:%lld fast:%lld timeouts:%lld probes:%lld dup_acks:%lld duplicates:%lld out_of_window:%lld drops:%lld\n",
+           c->retransmissions, c->fast_retransmissions, c->timeouts, c->window_probes, c->dup_acks, c->duplicates, c->out_of_window, c->drops);
+    printf("\t send_delay:%.3f/%.3f receive_delay:%.3f/%.3f\n",
+           mean_ms(c->send_delay, c->msgs_sent), c->send_delay_max / 1000.0,
+           mean_ms(c->receive_delay, c->msgs_delivered), c->receive_delay_max / 1000.0);
+
+    if (prev == NULL || elapsed <= 0)
+        return;
+    const mtp_counters *p = &prev->counters;
+    printf("\t rate: sent %.0f msg/s %.1f kB/s, delivered %.0f msg/s %.1f kB/s, retrans %.0f/s, send_delay %.3f, receive_delay %.3f\n",
+           (c->msgs_sent - p->msgs_sent) / elapsed, (c->bytes_sent - p->bytes_sent) / elapsed / 1000,
+           (c->msgs_delivered - p->msgs_delivered) / elapsed, (c->bytes_delivered - p->bytes_delivered) / elapsed / 1000,
+           (c->retransmissions - p->retransmissions) / elapsed,
+           mean_ms(c->send_delay - p->send_delay, c->msgs_sent - p->msgs_sent),
+           mean_ms(c->receive_delay - p->receive_delay, c->msgs_delivered - p->msgs_delivered));
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    if (m_init() < 0)
+    {
+        perror("m_init (is initmsocket running?)");
+        exit(1);
+    }
+
+    int size = 64, prev_count = 0;
+    mtp_stats *stats = malloc(sizeof(mtp_stats) * size);
+    mtp_stats *prev = malloc(sizeof(mtp_stats) * size);
+    if (stats == NULL || prev == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    double prev_time = 0;
+    for (int sample = 0; count < 0 || sample < count; sample++)
+    {
+        if (sample > 0)
+            usleep(interval_ms * 1000);
+
+        // the table may have grown since the last sample
+        int n = m_getstats_all(stats, size);
+        while (n > size)
+        {
+            size = n * 2;
+            stats = realloc(stats, sizeof(mtp_stats) * size);
+            prev = realloc(prev, sizeof(mtp_stats) * size);
+            if (stats == NULL || prev == NULL)
+            {
+                perror("realloc");
+                exit(1);
+            }
+            n = m_getstats_all(stats, size);
+        }
+        if (n < 0)
+        {
+            perror("m_getstats_all");
+            exit(1);
+        }
+        double t = now();
+        qsort(stats, n, sizeof(mtp_stats), by_sockfd);
+
+        if (sample > 0)
+            printf("\n");
+        printf("%-6s %-8s %-22s %-22s %-7s %-7s %s\n", "Sock", "PID", "Local", "Peer", "Send-Q", "Recv-Q", "Inflight");
+        for (int k = 0; k < n; k++)
+        {
+            if (only_pid != 0 && stats[k].pid != only_pid)
+                continue;
+            print_socket(&stats[k], sample > 0 ? find_prev(prev, prev_count, &stats[k]) : NULL, t - prev_time);
+        }
+        fflush(stdout);
+
+        mtp_stats *swap = prev;
+        prev = stats;
+        stats = swap;
+        prev_count = n;
+        prev_time = t;
+    }
+    free(stats);
+    free(prev);
+    return 0;
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "i:c:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            only_pid = atoi(optarg);
+            break;
+        default:
+            printf("Usage: mtpstat [-i interval_ms] [-c count] [-p pid]\n");
+            exit(1);
+        }
+    }
+    if (interval_ms < 0 || (interval_ms == 0 && count > 1))
+    {
+        printf("-c needs an interval (-i)\n");
+        exit(1);
+    }
+    // one sample without an interval, until interrupted with one
+    if (count < 0 && interval_ms == 0)
+        count = 1;
+}
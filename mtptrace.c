@@ -0,0 +1,249 @@
+/**
+ * @file mtptrace.c
+ *
+ * @brief Decoder of the binary trace of initmsocket -t (see mtp_trace.h).
+ * Merges the rings of the threads by time and prints a timeline per MTP socket (the events of no socket, the
+ * sleeps and wakeups of the workers, come last), or with -a a single timeline. The times are in ms since the
+ * daemon started tracing. Every ring keeps the last MTP_TRACE_RECORDS records of its thread.
+ *
+ * With -S mask it sets the event classes the running daemon traces instead (picked up within a second).
+ *
+ * Usage: ./mtptrace [-s sockfd] [-v mask] [-a] trace_file
+ *        ./mtptrace -S mask trace_file
+ */
+#include <msocket.h>
+#include <mtp_trace.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int only_sock = -2;
+long show_mask = TRACE_ALL;
+int merged = 0;
+long set_mask = -1;
+
+void parse_args(int argc, char *argv[]);
+
+// ---------------- Helper Functions ---------------- //
+// the sockets in increasing order, the events of no socket last, each in time order
+int by_socket(const void *a, const void *b)
+{
+    const mtp_trace_record *x = a, *y = b;
+    if (!merged && x->sock != y->sock)
+    {
+        if (x->sock < 0 || y->sock < 0)
+            return x->sock < 0 ? 1 : -1;
+        return x->sock < y->sock ? -1 : 1;
+    }
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->ring - y->ring;
+}
+
+const char *op_name(int op)
+{
+    return op == MTP_OP_SOCKET ? "socket" : op == MTP_OP_BIND ? "bind" : op == MTP_OP_CLOSE ? "close" : "unknown";
+}
+
+const char *drop_reason(int reason)
+{
+    static const char *reasons[] = {"emulated loss", "bottleneck", "invalid header", "invalid length"};
+    return reason >= 0 && reason < 4 ? reasons[reason] : "unknown";
+}
+
+// details of record r
+void describe(const mtp_trace_record *r, char *buf, size_t size)
+{
+    switch (r->event)
+    {
+    case TR_SEND:
+        snprintf(buf, size, "seq %u len %d in_flight %d", r->seq, r->a, r->b);
+        break;
+    case TR_RETRANSMIT:
+        snprintf(buf, size, "seq %u transmission %d rto %d ms", r->seq, r->a, r->b);
+        break;
+    case TR_FAST_RETRANSMIT:
+        snprintf(buf, size, "seq %u after %d duplicate ACKs, cwnd %d", r->seq, r->a, r->b);
+        break;
+    case TR_TIMEOUT:
+        snprintf(buf, size, "seq %u rto %d ms cwnd %d", r->seq, r->a, r->b);
+        break;
+    case TR_RECV_DATA:
+        snprintf(buf, size, "seq %u len %d rwnd %d", r->seq, r->a, r->b);
+        break;
+    case TR_DUPLICATE:
+        snprintf(buf, size, "seq %u", r->seq);
+        break;
+    case TR_OUT_OF_WINDOW:
+        snprintf(buf, size, "seq %u rwnd.base %u", r->seq, (uint32_t)r->a);
+        break;
+    case TR_ACK_SENT:
+        snprintf(buf, size, "ack %u window %d for seq %u", r->seq, r->a, (uint32_t)r->b);
+        break;
+    case TR_WINDOW_UPDATE:
+        snprintf(buf, size, "ack %u window %d", r->seq, r->a);
+        break;
+    case TR_RECV_ACK:
+        snprintf(buf, size, "ack %u acked %d window %d", r->seq, r->a, r->b);
+        break;
+    case TR_DUP_ACK:
+        snprintf(buf, size, "ack %u, %d in a row", r->seq, r->a);
+        break;
+    case TR_RTT:
+        snprintf(buf, size, "sample %.3f ms srtt %.3f ms", r->a / 1000.0, r->b / 1000.0);
+        break;
+    case TR_DROP:
+        snprintf(buf, size, "%s, %d bytes", drop_reason(r->a), r->b);
+        break;
+    case TR_SLEEP:
+        snprintf(buf, size, "for %d ms, %d timers", r->a, r->b);
+        break;
+    case TR_WAKEUP:
+        snprintf(buf, size, "%d events", r->a);
+        break;
+    case TR_REQUEST:
+        snprintf(buf, size, "%s, UDP socket %d", op_name(r->a), r->b);
+        break;
+    case TR_COLLECT:
+        snprintf(buf, size, "process %d", r->a);
+        break;
+    case TR_WINDOW_PROBE:
+        snprintf(buf, size, "seq %u, next probe in %d ms", r->seq, r->a);
+        break;
+    default:
+        snprintf(buf, size, "seq %u a %d b %d", r->seq, r->a, r->b);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    const char *path = argv[optind];
+    int fd = open(path, set_mask >= 0 ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+    if ((size_t)st.st_size < sizeof(mtp_trace_header))
+    {
+        printf("%s is not an MTP trace\n", path);
+        exit(1);
+    }
+    mtp_trace_header *h = mmap(NULL, st.st_size, set_mask >= 0 ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    size_t ring_size = sizeof(mtp_trace_ring) + sizeof(mtp_trace_record) * (size_t)h->ring_records;
+    if (memcmp(h->magic, MTP_TRACE_MAGIC, sizeof(h->magic)) != 0 || h->version != MTP_TRACE_VERSION || h->ring_records == 0 ||
+        (h->ring_records & (h->ring_records - 1)) != 0 || sizeof(mtp_trace_header) + ring_size * h->rings > (size_t)st.st_size)
+    {
+        printf("%s is not an MTP trace of this version\n", path);
+        exit(1);
+    }
+
+    if (set_mask >= 0)
+    {
+        __atomic_store_n(&h->mask, (uint32_t)set_mask, __ATOMIC_RELAXED);
+        printf("trace mask set to 0x%lx\n", set_mask);
+        return 0;
+    }
+
+    // the last ring_records records of every ring, oldest first
+    size_t total = 0;
+    for (uint32_t k = 0; k < h->rings; k++)
+    {
+        mtp_trace_ring *ring = (mtp_trace_ring *)((char *)h + sizeof(mtp_trace_header) + ring_size * k);
+        total += ring->head < h->ring_records ? ring->head : h->ring_records;
+    }
+    mtp_trace_record *records = malloc(sizeof(mtp_trace_record) * (total > 0 ? total : 1));
+    if (records == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    size_t n = 0;
+    for (uint32_t k = 0; k < h->rings; k++)
+    {
+        mtp_trace_ring *ring = (mtp_trace_ring *)((char *)h + sizeof(mtp_trace_header) + ring_size * k);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t from = head > h->ring_records ? head - h->ring_records : 0;
+        if (head - from > 0 && from > 0)
+            printf("%s: %llu older records were overwritten\n", ring->name, (unsigned long long)from);
+        for (uint64_t p = from; p < head && n < total; p++)
+        {
+            mtp_trace_record *r = &ring->records[p & (h->ring_records - 1)];
+            if (!(mtp_trace_event_class(r->event) & show_mask) || (only_sock != -2 && r->sock != only_sock))
+                continue;
+            records[n++] = *r;
+        }
+    }
+    qsort(records, n, sizeof(mtp_trace_record), by_socket);
+
+    char names[256][16];
+    for (uint32_t k = 0; k < h->rings && k < 256; k++)
+    {
+        mtp_trace_ring *ring = (mtp_trace_ring *)((char *)h + sizeof(mtp_trace_header) + ring_size * k);
+        memcpy(names[k], ring->name, sizeof(names[k]));
+        names[k][sizeof(names[k]) - 1] = '\0';
+    }
+
+    char details[128];
+    for (size_t k = 0; k < n; k++)
+    {
+        mtp_trace_record *r = &records[k];
+        if (!merged && (k == 0 || records[k - 1].sock != r->sock))
+        {
+            if (r->sock >= 0)
+                printf("%sMTP socket %d\n", k == 0 ? "" : "\n", r->sock);
+            else
+                printf("%sno socket\n", k == 0 ? "" : "\n");
+        }
+        describe(r, details, sizeof(details));
+        const char *name = mtp_trace_event_name(r->event);
+        double ms = r->time >= h->start ? (r->time - h->start) / 1e6 : 0;
+        if (merged)
+            printf("%12.3f  %-10s %4d  %-16s %s\n", ms, r->ring < 256 ? names[r->ring] : "?", r->sock, name != NULL ? name : "?", details);
+        else
+            printf("%12.3f  %-10s %-16s %s\n", ms, r->ring < 256 ? names[r->ring] : "?", name != NULL ? name : "?", details);
+    }
+    free(records);
+    return 0;
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:v:aS:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            only_sock = atoi(optarg);
+            break;
+        case 'v':
+            show_mask = mtp_trace_parse_mask(optarg);
+            break;
+        case 'a':
+            merged = 1;
+            break;
+        case 'S':
+            set_mask = mtp_trace_parse_mask(optarg);
+            if (set_mask < 0)
+                show_mask = -1;
+            break;
+        default:
+            show_mask = -1;
+        }
+    }
+    if (show_mask < 0 || optind != argc - 1)
+    {
+        printf("Usage: mtptrace [-s sockfd] [-v mask] [-a] trace_file\n       mtptrace -S mask trace_file\n");
+        printf("A mask is a number or a comma separated list of data, ack, loss, wake, req and all\n");
+        exit(1);
+    }
+}
@@ -3,10 +3,13 @@
 #include <netinet/in.h>
 #include <ifaddrs.h>
 #include <getopt.h>
+#include <endian.h>
 #include <msocket.h>
 
-#define MESSAGE_SIZE 1024
-int INF = 1e4;
+// size of a single write of the file, m_read gathers it from the messages
+#define CHUNK_SIZE 65536
+// timeout of a single m_read call in milliseconds
+int TIMEOUT = 700000;
 int sfd;
 int fd;
 int debug = 0;
@@ -56,41 +59,37 @@ int main(int argc, char *argv[])
     printf(GREEN "Bound to %s:%d -> %s:%d\n" RESET, ADDR, PORT, OTHER_ADDR, OTHER_PORT);
     prinfo();
 
-    struct sockaddr_in other_addr;
-    other_addr.sin_family = AF_INET;
-    other_addr.sin_port = htons(OTHER_PORT);
-    other_addr.sin_addr.s_addr = inet_addr(OTHER_ADDR);
-
-    char buff[1024];
-    int c = 0, msg_num = 0;
-    while (1)
+    // the sender sends the size of the file as a 64-bit big-endian number, then the file
+    static char buff[CHUNK_SIZE + 1];
+    uint64_t size = 0;
+    uint64_t received = 0;
+    int header = 0;
+    int chunk_num = 0;
+    while (header < (int)sizeof(size) || received < size)
     {
-        int len = sizeof(other_addr);
-        int rlen = -1;
-        c = 0;
-        while (rlen < 0)
+        // the size first, then at most what is left of the file
+        char *dst = header < (int)sizeof(size) ? (char *)&size + header : buff;
+        size_t want = header < (int)sizeof(size) ? sizeof(size) - header : size - received < CHUNK_SIZE ? size - received : CHUNK_SIZE;
+        // blocks until some bytes arrive, for at most 700 seconds
+        int rlen = m_read_timeout(sfd, dst, want, 0, TIMEOUT);
+        if (rlen < 0)
         {
-            rlen = m_recvfrom(sfd, buff, MESSAGE_SIZE, 0, (struct sockaddr *)&other_addr, &len);
-            if (rlen < 0)
-            {
-                // both of the statements combined give a max timeout of 700 seconds
-                usleep(70000);
-                c++;
-            }
-            if (c > INF)
-            {
+            if (errno == ETIMEDOUT)
                 pperror("Connection timed out\n");
-                sigint_handler(0);
-            }
+            else
+                pperror("m_read");
+            sigint_handler(0);
         }
-        if (buff[0] == '$')
+        if (header < (int)sizeof(size))
         {
-            ppblue("Received EOF\n");
-            break;
+            header += rlen;
+            if (header == sizeof(size))
+                size = be64toh(size);
+            continue;
         }
-        rlen = strlen(buff);
+        received += rlen;
 
-        printf(GREEN "Received Message %d\n" RESET, ++msg_num);
+        printf(GREEN "Received chunk %d\n" RESET, ++chunk_num);
         if (debug)
         {
             printf("-----------------------------\n");
@@ -3,9 +3,12 @@
 #include <netinet/in.h>
 #include <ifaddrs.h>
 #include <getopt.h>
+#include <endian.h>
+#include <sys/stat.h>
 #include <msocket.h>
 
-#define MESSAGE_SIZE 1024
+// size of a single read of the file, m_write cuts it into messages
+#define CHUNK_SIZE 65536
 int sfd;
 int fd;
 int debug = 0;
@@ -15,6 +18,7 @@ int OTHER_PORT = -1;
 char *OTHER_ADDR = "";
 void set_addr();
 void parse_args(int argc, char *argv[]);
+void write_all(const char *buf, int len);
 
 char *filename = NULL;
 void sigint_handler(int signum)
@@ -55,49 +59,37 @@ int main(int argc, char *argv[])
     printf(GREEN "Bound to %s:%d -> %s:%d\n" RESET, ADDR, PORT, OTHER_ADDR, OTHER_PORT);
     prinfo();
 
-    struct sockaddr_in other_addr;
-    other_addr.sin_family = AF_INET;
-    other_addr.sin_port = htons(OTHER_PORT);
-    other_addr.sin_addr.s_addr = inet_addr(OTHER_ADDR);
+    // the file goes as a byte stream, preceded by its size as a 64-bit big-endian number
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        pperror("fstat");
+        sigint_handler(-1);
+    }
+    uint64_t size = htobe64(st.st_size);
+    write_all((const char *)&size, sizeof(size));
 
-    char buff[1024];
-    int msg_num = 0;
+    static char buff[CHUNK_SIZE + 1];
+    int chunk_num = 0;
     while (1)
     {
-        int len = sizeof(other_addr);
-        int rlen = read(fd, buff, MESSAGE_SIZE);
+        int rlen = read(fd, buff, CHUNK_SIZE);
         if (rlen < 0)
         {
             pperror("read");
             sigint_handler(-1);
         }
-        else
+        if (rlen == 0)
+            break;
+        printf(GREEN "Sent chunk %d\n" RESET, ++chunk_num);
+        if (debug)
         {
-            if (rlen == 0)
-            {
-                buff[0] = '$';
-                printf(BLUE "Sending EOF\n" RESET);
-                m_sendto(sfd, buff, 1, MSG_EOR, (struct sockaddr *)&other_addr, len);
-                break;
-            }
-            printf(GREEN "Sent message %d\n" RESET, ++msg_num);
-            if (debug)
-            {
-                printf("-----------------------------\n");
-                buff[rlen] = '\0';
-                printf(GREEN "Sending:" RESET " %s\n", buff);
-                printf("-----------------------------\n");
-            }
-            int ret = -1;
-            while (ret < 0)
-            {
-                ret = m_sendto(sfd, buff, rlen, 0, (struct sockaddr *)&other_addr, len);
-                if (ret < 0)
-                {
-                    usleep(70000);
-                }
-            }
+            printf("-----------------------------\n");
+            buff[rlen] = '\0';
+            printf(GREEN "Sending:" RESET " %s\n", buff);
+            printf("-----------------------------\n");
         }
+        write_all(buff, rlen);
     }
 
     ppmagenta("File sent successfully\n");
@@ -108,6 +100,22 @@ int main(int argc, char *argv[])
 }
 
 // ---------------- Helper Functions ---------------- //
+// m_write blocks for send buffer space, but returns a short count if it fails after part of the data went in
+void write_all(const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int wlen = m_write(sfd, buf, len, 0);
+        if (wlen <= 0)
+        {
+            pperror("m_write");
+            sigint_handler(-1);
+        }
+        buf += wlen;
+        len -= wlen;
+    }
+}
+
 void set_addr()
 {
     // Retrieve IP addresses